@@ -11,6 +11,7 @@
 #include "compr.h"
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <linux/jffs2.h>
 
 #define FAVOUR_LZO_PERCENT 80
@@ -82,15 +83,76 @@ int jffs2_get_compression_mode(void)
 	return jffs2_compression_mode;
 }
 
+/* In size and favourlzo modes, stop trying compressors (in priority
+   order) once a page is down to this percentage of its size; 0 means
+   always try them all */
+static int jffs2_compression_cutoff = 0;
+
+void jffs2_set_compression_cutoff(int percent)
+{
+	jffs2_compression_cutoff = percent;
+}
+
 /* Statistics for blocks stored without compression */
 static uint32_t none_stat_compr_blocks=0,none_stat_decompr_blocks=0,none_stat_compr_size=0;
 
+/* Scratch memory, kept per thread so that pages can be compressed
+   concurrently. The scratch of the compressor threads is freed when they
+   exit, that of the main thread by jffs2_compressors_exit() */
+struct jffs2_scratch {
+	void *buf[JFFS2_NR_SCRATCH];
+	uint32_t size[JFFS2_NR_SCRATCH];
+	void (*release[JFFS2_NR_SCRATCH])(void *buf);
+};
+
+static pthread_key_t jffs2_scratch_key;
+
+static void jffs2_free_scratch_buf(struct jffs2_scratch *scratch, int which)
+{
+	if (scratch->buf[which] && scratch->release[which])
+		scratch->release[which](scratch->buf[which]);
+	free(scratch->buf[which]);
+	scratch->buf[which] = NULL;
+	scratch->size[which] = 0;
+}
+
+static void jffs2_free_scratch(void *p)
+{
+	struct jffs2_scratch *scratch = p;
+	int i;
+
+	for (i = 0; i < JFFS2_NR_SCRATCH; i++)
+		jffs2_free_scratch_buf(scratch, i);
+	free(scratch);
+}
+
+/* Get this thread's scratch buffer 'which' of at least 'size' bytes. A
+   new buffer is zeroed, and 'release' is called before it is freed */
+void *jffs2_get_scratch(int which, uint32_t size, void (*release)(void *buf))
+{
+	struct jffs2_scratch *scratch = pthread_getspecific(jffs2_scratch_key);
+
+	if (!scratch) {
+		scratch = calloc(1, sizeof(*scratch));
+		if (!scratch)
+			return NULL;
+		pthread_setspecific(jffs2_scratch_key, scratch);
+	}
+	if (scratch->size[which] < size) {
+		jffs2_free_scratch_buf(scratch, which);
+		scratch->buf[which] = calloc(1, size);
+		if (!scratch->buf[which])
+			return NULL;
+		scratch->size[which] = size;
+		scratch->release[which] = release;
+	}
+	return scratch->buf[which];
+}
+
 /* Compression test stuffs */
 
 static int jffs2_compression_check = 0;
 
-static unsigned char *jffs2_compression_check_buf = NULL;
-
 void jffs2_compression_check_set(int yesno)
 {
 	jffs2_compression_check = yesno;
@@ -123,6 +185,7 @@ static void jffs2_decompression_test(struct jffs2_compressor *compr,
 		uint32_t cdatalen, uint32_t datalen, uint32_t buf_size)
 {
 	uint32_t i;
+	unsigned char *check_buf;
 
 	/* buffer overflow test */
 	for (i=buf_size;i>cdatalen;i--) {
@@ -130,35 +193,33 @@ static void jffs2_decompression_test(struct jffs2_compressor *compr,
 			fprintf(stderr,"COMPR_ERROR: buffer overflow at %s. "
 					"(bs=%d csize=%d b[%d]=%d)\n", compr->name,
 					buf_size, cdatalen, i, (int)(output_buf[i]));
-			jffs2_error_cnt++;
-			return;
-		}
-	}
-	/* allocing temporary buffer for decompression */
-	if (!jffs2_compression_check_buf) {
-		jffs2_compression_check_buf = malloc(page_size);
-		if (!jffs2_compression_check_buf) {
-			fprintf(stderr,"No memory for buffer allocation. Compression check disabled.\n");
-			jffs2_compression_check = 0;
+			__sync_fetch_and_add(&jffs2_error_cnt, 1);
 			return;
 		}
 	}
 	/* decompressing */
 	if (!compr->decompress) {
 		fprintf(stderr,"JFFS2 compression check: there is no decompress function at %s.\n", compr->name);
-		jffs2_error_cnt++;
+		__sync_fetch_and_add(&jffs2_error_cnt, 1);
+		return;
+	}
+	/* allocing temporary buffer for decompression */
+	check_buf = jffs2_get_scratch(JFFS2_SCRATCH_CHECK, page_size, NULL);
+	if (!check_buf) {
+		fprintf(stderr,"No memory for buffer allocation. Compression check disabled.\n");
+		jffs2_compression_check = 0;
 		return;
 	}
-	if (compr->decompress(output_buf,jffs2_compression_check_buf,cdatalen,datalen)) {
+	if (compr->decompress(output_buf,check_buf,cdatalen,datalen)) {
 		fprintf(stderr,"JFFS2 compression check: decompression failed at %s.\n", compr->name);
-		jffs2_error_cnt++;
+		__sync_fetch_and_add(&jffs2_error_cnt, 1);
 	}
 	/* validate decompression */
 	else {
 		for (i=0;i<datalen;i++) {
-			if (data_in[i]!=jffs2_compression_check_buf[i]) {
+			if (data_in[i]!=check_buf[i]) {
 				fprintf(stderr,"JFFS2 compression check: data mismatch at %s (pos %d).\n", compr->name, i);
-				jffs2_error_cnt++;
+				__sync_fetch_and_add(&jffs2_error_cnt, 1);
 				break;
 			}
 		}
@@ -192,9 +253,10 @@ static int jffs2_is_best_compression(struct jffs2_compressor *this,
 	return 0;
 }
 
-/* jffs2_compress:
+/* jffs2_compress_nostat:
  * @data: Pointer to uncompressed data
- * @cdata: Pointer to returned pointer to buffer for compressed data
+ * @cdata: Buffer for the compressed data; it must be at least
+ *	JFFS2_COMPR_BUF_SIZE(*datalen) bytes long
  * @datalen: On entry, holds the amount of data available for compression.
  *	On exit, expected to hold the amount of data actually compressed.
  * @cdatalen: On entry, holds the amount of space available for compressed
@@ -203,20 +265,25 @@ static int jffs2_is_best_compression(struct jffs2_compressor *this,
  *
  * Returns: Lower byte to be stored with data indicating compression type used.
  * Zero is used to show that the data could not be compressed - the
- * compressed version was actually larger than the original.
+ * compressed version was actually larger than the original. In that case
+ * the data is to be stored as is and cdata holds nothing useful.
  * Upper byte will be used later. (soon)
  *
  * If the cdata buffer isn't large enough to hold all the uncompressed data,
  * jffs2_compress should compress as much as will fit, and should set
  * *datalen accordingly to show the amount of data which were compressed.
+ *
+ * Unlike jffs2_compress() this doesn't update the compressor statistics,
+ * so it may be called from several threads at once. Use
+ * jffs2_compress_account() for the results which are actually used.
  */
-uint16_t jffs2_compress( unsigned char *data_in, unsigned char **cpage_out,
+uint16_t jffs2_compress_nostat(unsigned char *data_in, unsigned char *cpage_out,
 		uint32_t *datalen, uint32_t *cdatalen)
 {
 	int ret = JFFS2_COMPR_NONE;
 	int compr_ret;
 	struct jffs2_compressor *this, *best=NULL;
-	unsigned char *output_buf = NULL, *tmp_buf;
+	unsigned char *output_buf, *tmp_buf, *swap_buf;
 	uint32_t orig_slen, orig_dlen;
 	uint32_t best_slen=0, best_dlen=0;
 
@@ -226,112 +293,120 @@ uint16_t jffs2_compress( unsigned char *data_in, unsigned char **cpage_out,
 		case JFFS2_COMPR_MODE_PRIORITY:
 			orig_slen = *datalen;
 			orig_dlen = *cdatalen;
-			output_buf = malloc(orig_dlen+jffs2_compression_check);
-			if (!output_buf) {
-				fprintf(stderr,"mkfs.jffs2: No memory for compressor allocation. Compression failed.\n");
-				goto out;
-			}
 			list_for_each_entry(this, &jffs2_compressor_list, list) {
 				/* Skip decompress-only backwards-compatibility and disabled modules */
 				if ((!this->compress)||(this->disabled))
 					continue;
 
-				this->usecount++;
+				__sync_fetch_and_add(&this->usecount, 1);
 
 				if (jffs2_compression_check) /*preparing output buffer for testing buffer overflow */
-					jffs2_decompression_test_prepare(output_buf, orig_dlen);
+					jffs2_decompression_test_prepare(cpage_out, orig_dlen);
 
 				*datalen  = orig_slen;
 				*cdatalen = orig_dlen;
-				compr_ret = this->compress(data_in, output_buf, datalen, cdatalen);
-				this->usecount--;
+				compr_ret = this->compress(data_in, cpage_out, datalen, cdatalen);
+				__sync_fetch_and_sub(&this->usecount, 1);
 				if (!compr_ret) {
 					ret = this->compr;
-					this->stat_compr_blocks++;
-					this->stat_compr_orig_size += *datalen;
-					this->stat_compr_new_size  += *cdatalen;
 					if (jffs2_compression_check)
-						jffs2_decompression_test(this, data_in, output_buf, *cdatalen, *datalen, orig_dlen);
+						jffs2_decompression_test(this, data_in, cpage_out, *cdatalen, *datalen, orig_dlen);
 					break;
 				}
 			}
-			if (ret == JFFS2_COMPR_NONE) free(output_buf);
 			break;
 		case JFFS2_COMPR_MODE_FAVOURLZO:
 		case JFFS2_COMPR_MODE_SIZE:
 			orig_slen = *datalen;
 			orig_dlen = *cdatalen;
+			/* The best result so far is in output_buf, the candidate
+			   being tried goes to tmp_buf; they swap when it wins */
+			output_buf = cpage_out;
+			tmp_buf = jffs2_get_scratch(JFFS2_SCRATCH_CANDIDATE,
+						    JFFS2_COMPR_BUF_SIZE(orig_slen),
+						    NULL);
+			if (!tmp_buf) {
+				fprintf(stderr,"mkfs.jffs2: No memory for compressor allocation. (%d bytes)\n",orig_dlen);
+				break;
+			}
 			list_for_each_entry(this, &jffs2_compressor_list, list) {
-				uint32_t needed_buf_size;
-
-				if (jffs2_compression_mode == JFFS2_COMPR_MODE_FAVOURLZO)
-					needed_buf_size = orig_slen + jffs2_compression_check;
-				else
-					needed_buf_size = orig_dlen + jffs2_compression_check;
-
 				/* Skip decompress-only backwards-compatibility and disabled modules */
 				if ((!this->compress)||(this->disabled))
 					continue;
-				/* Allocating memory for output buffer if necessary */
-				if ((this->compr_buf_size < needed_buf_size) && (this->compr_buf)) {
-					free(this->compr_buf);
-					this->compr_buf_size=0;
-					this->compr_buf=NULL;
-				}
-				if (!this->compr_buf) {
-					tmp_buf = malloc(needed_buf_size);
-					if (!tmp_buf) {
-						fprintf(stderr,"mkfs.jffs2: No memory for compressor allocation. (%d bytes)\n",orig_dlen);
-						continue;
-					}
-					else {
-						this->compr_buf = tmp_buf;
-						this->compr_buf_size = orig_dlen;
-					}
-				}
-				this->usecount++;
+				__sync_fetch_and_add(&this->usecount, 1);
 				if (jffs2_compression_check) /*preparing output buffer for testing buffer overflow */
-					jffs2_decompression_test_prepare(this->compr_buf,this->compr_buf_size);
+					jffs2_decompression_test_prepare(tmp_buf, orig_dlen);
 				*datalen  = orig_slen;
 				*cdatalen = orig_dlen;
-				compr_ret = this->compress(data_in, this->compr_buf, datalen, cdatalen);
-				this->usecount--;
+				compr_ret = this->compress(data_in, tmp_buf, datalen, cdatalen);
+				__sync_fetch_and_sub(&this->usecount, 1);
 				if (!compr_ret) {
 					if (jffs2_compression_check)
-						jffs2_decompression_test(this, data_in, this->compr_buf, *cdatalen, *datalen, this->compr_buf_size);
+						jffs2_decompression_test(this, data_in, tmp_buf, *cdatalen, *datalen, orig_dlen);
 					if (((!best_dlen) || jffs2_is_best_compression(this, best, *cdatalen, best_dlen))
 								&& (*cdatalen < *datalen)) {
 						best_dlen = *cdatalen;
 						best_slen = *datalen;
 						best = this;
+						swap_buf = output_buf;
+						output_buf = tmp_buf;
+						tmp_buf = swap_buf;
+						if (best_dlen * 100 <= best_slen * jffs2_compression_cutoff)
+							break;
 					}
 				}
 			}
 			if (best_dlen) {
 				*cdatalen = best_dlen;
 				*datalen  = best_slen;
-				output_buf = best->compr_buf;
-				best->compr_buf = NULL;
-				best->compr_buf_size = 0;
-				best->stat_compr_blocks++;
-				best->stat_compr_orig_size += best_slen;
-				best->stat_compr_new_size  += best_dlen;
+				if (output_buf != cpage_out)
+					memcpy(cpage_out, output_buf, best_dlen);
 				ret = best->compr;
 			}
 			break;
 		default:
 			fprintf(stderr,"mkfs.jffs2: unknown compression mode.\n");
 	}
-out:
-	if (ret == JFFS2_COMPR_NONE) {
-		*cpage_out = data_in;
+	if (ret == JFFS2_COMPR_NONE)
 		*datalen = *cdatalen;
+	return ret;
+}
+
+/* jffs2_compress_account:
+ * Add a result of jffs2_compress_nostat() to the compressor statistics.
+ * @compression, @datalen and @cdatalen are as returned by it.
+ */
+void jffs2_compress_account(uint16_t compression, uint32_t datalen,
+		uint32_t cdatalen)
+{
+	struct jffs2_compressor *this;
+
+	if ((compression & 0xff) == JFFS2_COMPR_NONE) {
 		none_stat_compr_blocks++;
-		none_stat_compr_size += *datalen;
+		none_stat_compr_size += datalen;
+		return;
 	}
-	else {
-		*cpage_out = output_buf;
+	list_for_each_entry(this, &jffs2_compressor_list, list) {
+		if (this->compr == (compression & 0xff)) {
+			this->stat_compr_blocks++;
+			this->stat_compr_orig_size += datalen;
+			this->stat_compr_new_size  += cdatalen;
+			return;
+		}
 	}
+}
+
+/* jffs2_compress:
+ * Same as jffs2_compress_nostat(), but accounts the result in the
+ * compressor statistics.
+ */
+uint16_t jffs2_compress(unsigned char *data_in, unsigned char *cpage_out,
+		uint32_t *datalen, uint32_t *cdatalen)
+{
+	uint16_t ret;
+
+	ret = jffs2_compress_nostat(data_in, cpage_out, datalen, cdatalen);
+	jffs2_compress_account(ret, *datalen, *cdatalen);
 	return ret;
 }
 
@@ -344,8 +419,6 @@ int jffs2_register_compressor(struct jffs2_compressor *comp)
 		fprintf(stderr,"NULL compressor name at registering JFFS2 compressor. Failed.\n");
 		return -1;
 	}
-	comp->compr_buf_size=0;
-	comp->compr_buf=NULL;
 	comp->usecount=0;
 	comp->stat_compr_orig_size=0;
 	comp->stat_compr_new_size=0;
@@ -419,6 +492,8 @@ char *jffs2_stats(void)
 			act_buf += sprintf(act_buf, "unknown");
 			break;
 	}
+	if (jffs2_compression_cutoff)
+		act_buf += sprintf(act_buf, " (cutoff %d%%)", jffs2_compression_cutoff);
 	act_buf += sprintf(act_buf,"\nCompressors:\n");
 	act_buf += sprintf(act_buf,"%10s             ","none");
 	act_buf += sprintf(act_buf,"compr: %d blocks (%d)  decompr: %d blocks\n", none_stat_compr_blocks,
@@ -511,6 +586,8 @@ reinsert:
 
 int jffs2_compressors_init(void)
 {
+	if (pthread_key_create(&jffs2_scratch_key, jffs2_free_scratch))
+		return -1;
 #ifdef CONFIG_JFFS2_ZLIB
 	jffs2_zlib_init();
 #endif
@@ -534,5 +611,8 @@ int jffs2_compressors_exit(void)
 #ifdef CONFIG_JFFS2_LZO
 	jffs2_lzo_exit();
 #endif
+	if (pthread_getspecific(jffs2_scratch_key))
+		jffs2_free_scratch(pthread_getspecific(jffs2_scratch_key));
+	pthread_key_delete(jffs2_scratch_key);
 	return 0;
 }
@@ -58,6 +58,7 @@ struct list_head {
 void jffs2_set_compression_mode(int mode);
 int jffs2_get_compression_mode(void);
 int jffs2_set_compression_mode_name(const char *mode_name);
+void jffs2_set_compression_cutoff(int percent);
 
 int jffs2_enable_compressor_name(const char *name);
 int jffs2_disable_compressor_name(const char *name);
@@ -75,8 +76,6 @@ struct jffs2_compressor {
 			uint32_t cdatalen, uint32_t datalen);
 	int usecount;
 	int disabled;             /* if seted the compressor won't compress */
-	unsigned char *compr_buf; /* used by size compr. mode */
-	uint32_t compr_buf_size;  /* used by size compr. mode */
 	uint32_t stat_compr_orig_size;
 	uint32_t stat_compr_new_size;
 	uint32_t stat_compr_blocks;
@@ -89,8 +88,25 @@ int jffs2_unregister_compressor(struct jffs2_compressor *comp);
 int jffs2_compressors_init(void);
 int jffs2_compressors_exit(void);
 
-uint16_t jffs2_compress(unsigned char *data_in, unsigned char **cpage_out,
+/* Per-thread scratch memory of the compressors */
+#define JFFS2_SCRATCH_CANDIDATE	0	/* candidate output in size/favourlzo mode */
+#define JFFS2_SCRATCH_CHECK	1	/* decompressed data of the compression check */
+#define JFFS2_SCRATCH_LZO	2	/* LZO work memory and output */
+#define JFFS2_SCRATCH_ZLIB	3	/* zlib deflate stream */
+#define JFFS2_NR_SCRATCH	4
+
+void *jffs2_get_scratch(int which, uint32_t size, void (*release)(void *buf));
+
+/* Size of the output buffer for compressing len bytes; the compression
+   check looks one byte past the end of the compressed data */
+#define JFFS2_COMPR_BUF_SIZE(len)   ((len) + 1)
+
+uint16_t jffs2_compress(unsigned char *data_in, unsigned char *cpage_out,
+		uint32_t *datalen, uint32_t *cdatalen);
+uint16_t jffs2_compress_nostat(unsigned char *data_in, unsigned char *cpage_out,
 		uint32_t *datalen, uint32_t *cdatalen);
+void jffs2_compress_account(uint16_t compression, uint32_t datalen,
+		uint32_t cdatalen);
 
 /* If it is setted, a decompress will be called after every compress */
 void jffs2_compression_check_set(int yesno);
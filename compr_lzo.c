@@ -33,9 +33,6 @@
 
 extern int page_size;
 
-static void *lzo_mem;
-static void *lzo_compress_buf;
-
 /*
  * Note about LZO compression.
  *
@@ -51,8 +48,16 @@ static int jffs2_lzo_cmpr(unsigned char *data_in, unsigned char *cpage_out,
 			  uint32_t *sourcelen, uint32_t *dstlen)
 {
 	lzo_uint compress_size;
+	unsigned char *lzo_mem, *lzo_compress_buf;
 	int ret;
 
+	/* Worse case LZO compression size from their FAQ */
+	lzo_mem = jffs2_get_scratch(JFFS2_SCRATCH_LZO, LZO1X_999_MEM_COMPRESS +
+				    page_size + (page_size / 16) + 64 + 3, NULL);
+	if (!lzo_mem)
+		return -1;
+	lzo_compress_buf = lzo_mem + LZO1X_999_MEM_COMPRESS;
+
 	ret = lzo1x_999_compress(data_in, *sourcelen, lzo_compress_buf, &compress_size, lzo_mem);
 
 	if (ret != LZO_E_OK)
@@ -92,33 +97,12 @@ static struct jffs2_compressor jffs2_lzo_comp = {
 
 int jffs2_lzo_init(void)
 {
-	int ret;
-
-	lzo_mem = malloc(LZO1X_999_MEM_COMPRESS);
-	if (!lzo_mem)
-		return -1;
-
-	/* Worse case LZO compression size from their FAQ */
-	lzo_compress_buf = malloc(page_size + (page_size / 16) + 64 + 3);
-	if (!lzo_compress_buf) {
-		free(lzo_mem);
-		return -1;
-	}
-
-	ret = jffs2_register_compressor(&jffs2_lzo_comp);
-	if (ret < 0) {
-		free(lzo_compress_buf);
-		free(lzo_mem);
-	}
-
-	return ret;
+	return jffs2_register_compressor(&jffs2_lzo_comp);
 }
 
 void jffs2_lzo_exit(void)
 {
 	jffs2_unregister_compressor(&jffs2_lzo_comp);
-	free(lzo_compress_buf);
-	free(lzo_mem);
 }
 
 #else
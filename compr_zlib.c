@@ -53,51 +53,70 @@ Q: Is 12 bytes sufficient?
  */
 #define STREAM_END_SPACE 12
 
+/*
+ * deflateInit() allocates a few hundred KiB of state, so each thread keeps
+ * its stream and just resets it for the next page.
+ */
+static void zlib_end_stream(void *strm)
+{
+	if (((z_stream *)strm)->state)
+		deflateEnd(strm);
+}
+
+static z_stream *zlib_get_stream(void)
+{
+	z_stream *strm;
+
+	strm = jffs2_get_scratch(JFFS2_SCRATCH_ZLIB, sizeof(*strm),
+				 zlib_end_stream);
+	if (!strm)
+		return NULL;
+	if (strm->state)
+		return deflateReset(strm) == Z_OK ? strm : NULL;
+
+	if (Z_OK != deflateInit(strm, 3))
+		return NULL;
+	return strm;
+}
+
 static int jffs2_zlib_compress(unsigned char *data_in, unsigned char *cpage_out,
 		uint32_t *sourcelen, uint32_t *dstlen)
 {
-	z_stream strm;
+	z_stream *strm;
 	int ret;
 
 	if (*dstlen <= STREAM_END_SPACE)
 		return -1;
 
-	strm.zalloc = (void *)0;
-	strm.zfree = (void *)0;
-
-	if (Z_OK != deflateInit(&strm, 3)) {
+	strm = zlib_get_stream();
+	if (!strm)
 		return -1;
-	}
-	strm.next_in = data_in;
-	strm.total_in = 0;
 
-	strm.next_out = cpage_out;
-	strm.total_out = 0;
+	strm->next_in = data_in;
+	strm->total_in = 0;
 
-	while (strm.total_out < *dstlen - STREAM_END_SPACE && strm.total_in < *sourcelen) {
-		strm.avail_out = *dstlen - (strm.total_out + STREAM_END_SPACE);
-		strm.avail_in = min((unsigned)(*sourcelen-strm.total_in), strm.avail_out);
-		ret = deflate(&strm, Z_PARTIAL_FLUSH);
-		if (ret != Z_OK) {
-			deflateEnd(&strm);
+	strm->next_out = cpage_out;
+	strm->total_out = 0;
+
+	while (strm->total_out < *dstlen - STREAM_END_SPACE && strm->total_in < *sourcelen) {
+		strm->avail_out = *dstlen - (strm->total_out + STREAM_END_SPACE);
+		strm->avail_in = min((unsigned)(*sourcelen-strm->total_in), strm->avail_out);
+		ret = deflate(strm, Z_PARTIAL_FLUSH);
+		if (ret != Z_OK)
 			return -1;
-		}
 	}
-	strm.avail_out += STREAM_END_SPACE;
-	strm.avail_in = 0;
-	ret = deflate(&strm, Z_FINISH);
-	if (ret != Z_STREAM_END) {
-		deflateEnd(&strm);
+	strm->avail_out += STREAM_END_SPACE;
+	strm->avail_in = 0;
+	ret = deflate(strm, Z_FINISH);
+	if (ret != Z_STREAM_END)
 		return -1;
-	}
-	deflateEnd(&strm);
 
-	if (strm.total_out >= strm.total_in)
+	if (strm->total_out >= strm->total_in)
 		return -1;
 
 
-	*dstlen = strm.total_out;
-	*sourcelen = strm.total_in;
+	*dstlen = strm->total_out;
+	*sourcelen = strm->total_in;
 	return 0;
 }
 
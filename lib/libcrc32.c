@@ -38,6 +38,30 @@
  */
 
 #include <stdint.h>
+#include <string.h>
+
+/*
+ * Large buffers are processed using the PCLMULQDQ carry-less multiplication
+ * instruction on x86 and the CRC32 instructions on ARMv8, if the CPU has
+ * them. The code for them is built for the respective instruction set
+ * extensions and only called if the CPU supports them, so the library still
+ * works on any CPU of the architecture.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+#define CRC32_PCLMUL
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__AARCH64EL__) && \
+    (__GNUC__ >= 10 || defined(__clang__))
+#define CRC32_ARM64
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_acle.h>
+#endif
 
 static const uint32_t crc32_table[256] = {
 	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
@@ -94,11 +118,172 @@ static const uint32_t crc32_table[256] = {
 	0x2d02ef8dL
 };
 
-uint32_t mtd_crc32(uint32_t val, const void *ss, int len)
+/*
+ * Tables for the slice-by-8 algorithm: crc32_tables[n][b] is the CRC of byte
+ * @b followed by @n zero bytes. They are derived from crc32_table at start-up.
+ */
+static uint32_t crc32_tables[8][256];
+
+#ifdef CRC32_PCLMUL
+static int crc32_use_pclmul;
+#endif
+#ifdef CRC32_ARM64
+static int crc32_use_arm64;
+#endif
+
+static void __attribute__((constructor)) crc32_init(void)
 {
-	const unsigned char *s = ss;
+	uint32_t v;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		v = crc32_table[i];
+		for (j = 0; j < 8; j++) {
+			crc32_tables[j][i] = v;
+			v = crc32_table[v & 0xff] ^ (v >> 8);
+		}
+	}
 
+#ifdef CRC32_PCLMUL
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+		    (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1))
+			crc32_use_pclmul = 1;
+	}
+#endif
+#ifdef CRC32_ARM64
+	crc32_use_arm64 = !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+#endif
+}
+
+/* Slice-by-8: process 8 bytes per step using 8 tables */
+static uint32_t crc32_sb8(uint32_t val, const unsigned char *s, int len)
+{
+	uint32_t one, two;
+
+	while (len >= 8) {
+		one = val ^ (s[0] | s[1] << 8 | s[2] << 16 |
+			     (uint32_t)s[3] << 24);
+		two = s[4] | s[5] << 8 | s[6] << 16 | (uint32_t)s[7] << 24;
+		val = crc32_tables[7][one & 0xff] ^
+		      crc32_tables[6][(one >> 8) & 0xff] ^
+		      crc32_tables[5][(one >> 16) & 0xff] ^
+		      crc32_tables[4][one >> 24] ^
+		      crc32_tables[3][two & 0xff] ^
+		      crc32_tables[2][(two >> 8) & 0xff] ^
+		      crc32_tables[1][(two >> 16) & 0xff] ^
+		      crc32_tables[0][two >> 24];
+		s += 8;
+		len -= 8;
+	}
 	while (--len >= 0)
 		val = crc32_table[(val ^ *s++) & 0xff] ^ (val >> 8);
 	return val;
 }
+
+#ifdef CRC32_PCLMUL
+#define CLMUL _mm_clmulepi64_si128
+
+/* Fold a 128-bit value forward and add the next 128 bits of data */
+#define FOLD(x, k, data) \
+	_mm_xor_si128(_mm_xor_si128(CLMUL(x, k, 0x00), CLMUL(x, k, 0x11)), data)
+
+/*
+ * CRC of a multiple of 16 bytes, at least 64, by folding with carry-less
+ * multiplication and a final Barrett reduction. See "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" by Intel. The constants are
+ * those of the Linux kernel crc32-pclmul implementation.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t val, const unsigned char *s, int len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596ULL, 0x154442bd4ULL);
+	const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eULL, 0x1751997d0ULL);
+	const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124ULL);
+	const __m128i poly = _mm_set_epi64x(0x1f7011641ULL, 0x1db710641ULL);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, ~0);
+	const __m128i *p = (const __m128i *)s;
+	__m128i x1, x2, x3, x4;
+
+	x1 = _mm_xor_si128(_mm_loadu_si128(p), _mm_cvtsi32_si128(val));
+	x2 = _mm_loadu_si128(p + 1);
+	x3 = _mm_loadu_si128(p + 2);
+	x4 = _mm_loadu_si128(p + 3);
+	p += 4;
+	len -= 64;
+
+	/* Fold 64 bytes at a time */
+	while (len >= 64) {
+		x1 = FOLD(x1, k1k2, _mm_loadu_si128(p));
+		x2 = FOLD(x2, k1k2, _mm_loadu_si128(p + 1));
+		x3 = FOLD(x3, k1k2, _mm_loadu_si128(p + 2));
+		x4 = FOLD(x4, k1k2, _mm_loadu_si128(p + 3));
+		p += 4;
+		len -= 64;
+	}
+
+	/* Fold into 128 bits */
+	x1 = FOLD(x1, k3k4, x2);
+	x1 = FOLD(x1, k3k4, x3);
+	x1 = FOLD(x1, k3k4, x4);
+	while (len >= 16) {
+		x1 = FOLD(x1, k3k4, _mm_loadu_si128(p));
+		p += 1;
+		len -= 16;
+	}
+
+	/* Reduce to 64 bits, then 32 bits */
+	x2 = CLMUL(k3k4, x1, 0x01);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = CLMUL(_mm_and_si128(x1, mask32), k5, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction */
+	x2 = x1;
+	x1 = CLMUL(_mm_and_si128(x1, mask32), poly, 0x10);
+	x1 = CLMUL(_mm_and_si128(x1, mask32), poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+#ifdef CRC32_ARM64
+__attribute__((target("+crc")))
+static uint32_t crc32_arm64(uint32_t val, const unsigned char *s, int len)
+{
+	uint64_t v;
+
+	while (len >= 8) {
+		memcpy(&v, s, 8);
+		val = __crc32d(val, v);
+		s += 8;
+		len -= 8;
+	}
+	while (--len >= 0)
+		val = __crc32b(val, *s++);
+	return val;
+}
+#endif
+
+uint32_t mtd_crc32(uint32_t val, const void *ss, int len)
+{
+	const unsigned char *s = ss;
+
+#ifdef CRC32_PCLMUL
+	if (crc32_use_pclmul && len >= 64) {
+		int n = len & ~15;
+
+		val = crc32_pclmul(val, s, n);
+		s += n;
+		len -= n;
+	}
+#endif
+#ifdef CRC32_ARM64
+	if (crc32_use_arm64)
+		return crc32_arm64(val, s, len);
+#endif
+	return crc32_sb8(val, s, len);
+}
@@ -46,6 +46,29 @@
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * With 8 bit elements, addmul1() uses the vector byte shuffle instructions
+ * (PSHUFB with SSSE3 or AVX2 on x86, TBL/VTBL with NEON on ARM) to multiply
+ * 16 or 32 bytes at a time. The x86 code is built for the respective
+ * instruction set extension and only called if the CPU supports it, NEON is
+ * used whenever the compiler targets it.
+ */
+#if (GF_BITS == 8) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+#define FEC_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if (GF_BITS == 8) && defined(__ARM_NEON)
+#define FEC_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(FEC_X86) || defined(FEC_NEON)
+#define FEC_SIMD
+#endif
+
 /*
  * stuff used for testing purposes only
  */
@@ -184,6 +207,35 @@ static gf gf_mul_table[GF_SIZE + 1][GF_SIZE + 1];
 #define GF_MULC0(c) __gf_mulc_ = gf_mul_table[c]
 #define GF_ADDMULC(dst, x) dst ^= __gf_mulc_[x]
 
+#ifdef FEC_SIMD
+/*
+ * c * x is computed as c * (x & 0x0f) ^ c * (x & 0xf0), looking up both
+ * products in 16 entry tables with a vector shuffle.
+ * gf_nib_table[c][0][i] is c * i, gf_nib_table[c][1][i] is c * (i << 4).
+ */
+static gf gf_nib_table[GF_SIZE + 1][2][16] __attribute__((aligned(16)));
+
+#ifdef FEC_X86
+static int fec_use_ssse3;
+static int fec_use_avx2;
+#endif
+#ifdef FEC_NEON
+static int fec_use_neon;
+#endif
+
+static void
+init_nibble_tables(void)
+{
+    int c, i;
+
+    for (c = 0; c < GF_SIZE + 1; c++)
+	for (i = 0; i < 16; i++) {
+	    gf_nib_table[c][0][i] = gf_mul_table[c][i];
+	    gf_nib_table[c][1][i] = gf_mul_table[c][i << 4];
+	}
+}
+#endif /* FEC_SIMD */
+
 static void
 init_mul_table(void)
 {
@@ -194,6 +246,9 @@ init_mul_table(void)
 
     for (j=0; j< GF_SIZE+1; j++)
 	    gf_mul_table[0][j] = gf_mul_table[j][0] = 0;
+#ifdef FEC_SIMD
+    init_nibble_tables();
+#endif
 }
 #else	/* GF_BITS > 8 */
 static inline gf
@@ -323,7 +378,7 @@ generate_gf(void)
 
 #define UNROLL 16 /* 1, 4, 8, 16 */
 static void
-addmul1(gf *dst1, gf *src1, gf c, int sz)
+addmul1_scalar(gf *dst1, gf *src1, gf c, int sz)
 {
     USE_GF_MULC ;
     register gf *dst = dst1, *src = src1 ;
@@ -360,6 +415,139 @@ addmul1(gf *dst1, gf *src1, gf c, int sz)
 	GF_ADDMULC( *dst , *src );
 }
 
+/*
+ * The vector versions of addmul1() process as many whole vectors as
+ * there are in sz bytes and return the number of bytes done.
+ */
+#ifdef FEC_X86
+__attribute__((target("ssse3")))
+static int
+addmul1_ssse3(gf *dst, gf *src, gf c, int sz)
+{
+    __m128i lo = _mm_load_si128((const __m128i *)gf_nib_table[c][0]);
+    __m128i hi = _mm_load_si128((const __m128i *)gf_nib_table[c][1]);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i x, d;
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16) {
+	x = _mm_loadu_si128((const __m128i *)(src + i));
+	d = _mm_loadu_si128((const __m128i *)(dst + i));
+	d = _mm_xor_si128(d, _mm_shuffle_epi8(lo, _mm_and_si128(x, mask)));
+	x = _mm_and_si128(_mm_srli_epi64(x, 4), mask);
+	d = _mm_xor_si128(d, _mm_shuffle_epi8(hi, x));
+	_mm_storeu_si128((__m128i *)(dst + i), d);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int
+addmul1_avx2(gf *dst, gf *src, gf c, int sz)
+{
+    __m256i lo, hi, mask, x, d;
+    int i;
+
+    lo = _mm256_broadcastsi128_si256(
+		_mm_load_si128((const __m128i *)gf_nib_table[c][0]));
+    hi = _mm256_broadcastsi128_si256(
+		_mm_load_si128((const __m128i *)gf_nib_table[c][1]));
+    mask = _mm256_set1_epi8(0x0f);
+
+    for (i = 0; i + 32 <= sz; i += 32) {
+	x = _mm256_loadu_si256((const __m256i *)(src + i));
+	d = _mm256_loadu_si256((const __m256i *)(dst + i));
+	d = _mm256_xor_si256(d,
+		_mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)));
+	x = _mm256_and_si256(_mm256_srli_epi64(x, 4), mask);
+	d = _mm256_xor_si256(d, _mm256_shuffle_epi8(hi, x));
+	_mm256_storeu_si256((__m256i *)(dst + i), d);
+    }
+    return i;
+}
+
+static void
+init_simd(void)
+{
+    unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+	return;
+    fec_use_ssse3 = !!(ecx & bit_SSSE3);
+
+    /* AVX2 also needs the OS to save the YMM registers */
+    if (!(ecx & bit_OSXSAVE) || __get_cpuid_max(0, NULL) < 7)
+	return;
+    __asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6)
+	return;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    fec_use_avx2 = !!(ebx & bit_AVX2);
+}
+#endif /* FEC_X86 */
+
+#ifdef FEC_NEON
+static int
+addmul1_neon(gf *dst, gf *src, gf c, int sz)
+{
+#ifdef __aarch64__
+    uint8x16_t lo = vld1q_u8(gf_nib_table[c][0]);
+    uint8x16_t hi = vld1q_u8(gf_nib_table[c][1]);
+#define NIB_LOOKUP(t, x) vqtbl1q_u8(t, x)
+#else
+    uint8x8x2_t lo = { { vld1_u8(gf_nib_table[c][0]),
+			 vld1_u8(gf_nib_table[c][0] + 8) } };
+    uint8x8x2_t hi = { { vld1_u8(gf_nib_table[c][1]),
+			 vld1_u8(gf_nib_table[c][1] + 8) } };
+#define NIB_LOOKUP(t, x) \
+	vcombine_u8(vtbl2_u8(t, vget_low_u8(x)), vtbl2_u8(t, vget_high_u8(x)))
+#endif
+    uint8x16_t mask = vdupq_n_u8(0x0f);
+    uint8x16_t x, d;
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16) {
+	x = vld1q_u8(src + i);
+	d = vld1q_u8(dst + i);
+	d = veorq_u8(d, NIB_LOOKUP(lo, vandq_u8(x, mask)));
+	d = veorq_u8(d, NIB_LOOKUP(hi, vshrq_n_u8(x, 4)));
+	vst1q_u8(dst + i, d);
+    }
+#undef NIB_LOOKUP
+    return i;
+}
+
+static void
+init_simd(void)
+{
+    fec_use_neon = 1;
+}
+#endif /* FEC_NEON */
+
+static void
+addmul1(gf *dst, gf *src, gf c, int sz)
+{
+#ifdef FEC_SIMD
+    int done = 0;
+
+#ifdef FEC_X86
+    if (fec_use_avx2)
+	done = addmul1_avx2(dst, src, c, sz);
+    else if (fec_use_ssse3)
+	done = addmul1_ssse3(dst, src, c, sz);
+#endif
+#ifdef FEC_NEON
+    if (fec_use_neon)
+	done = addmul1_neon(dst, src, c, sz);
+#endif
+    dst += done;
+    src += done;
+    sz -= done;
+#endif
+    if (sz > 0)
+	addmul1_scalar(dst, src, c, sz);
+}
+
 /*
  * computes C = AB where A is n*k, B is k*m, C is n*m
  */
@@ -611,6 +799,9 @@ init_fec(void)
     DDB(fprintf(stderr, "generate_gf took %ldus\n", ticks[0]);)
     TICK(ticks[0]);
     init_mul_table();
+#ifdef FEC_SIMD
+    init_simd();
+#endif
     TOCK(ticks[0]);
     DDB(fprintf(stderr, "init_mul_table took %ldus\n", ticks[0]);)
     fec_initialized = 1 ;
@@ -624,10 +815,26 @@ init_fec(void)
 
 #define FEC_MAGIC	0xFECC0DEC
 
+/*
+ * Inverting the decode matrix costs O(k^3), but on a lossy link the same
+ * sets of packets tend to get lost over and over again. So the last few
+ * decode matrices are kept, keyed by the packet indexes they were built
+ * for, and the least recently used one is replaced on a miss.
+ */
+#define DEC_CACHE_SIZE 8
+
+struct dec_matrix {
+    int *index ;	/* packet indexes after shuffle(), NULL if unused */
+    gf *m_dec ;		/* inverted decode matrix */
+    u_long used ;	/* value of dec_clock when last used */
+} ;
+
 struct fec_parms {
     u_long magic ;
     int k, n ;		/* parameters of the code */
     gf *enc_matrix ;
+    struct dec_matrix dec_cache[DEC_CACHE_SIZE] ;
+    u_long dec_clock ;
 } ;
 #define COMP_FEC_MAGIC(fec) \
 	(((FEC_MAGIC ^ (fec)->k) ^ (fec)->n) ^ (unsigned long)((fec)->enc_matrix))
@@ -635,10 +842,16 @@ struct fec_parms {
 void
 fec_free(struct fec_parms *p)
 {
+    int i ;
+
     if (p==NULL || p->magic != COMP_FEC_MAGIC(p)) {
 	fprintf(stderr, "bad parameters to fec_free\n");
 	return ;
     }
+    for (i = 0 ; i < DEC_CACHE_SIZE ; i++) {
+	free(p->dec_cache[i].index);
+	free(p->dec_cache[i].m_dec);
+    }
     free(p->enc_matrix);
     free(p);
 }
@@ -668,6 +881,8 @@ fec_new(int k, int n)
     retval->n = n ;
     retval->enc_matrix = NEW_GF_MATRIX(n, k);
     retval->magic = COMP_FEC_MAGIC(retval);
+    memset(retval->dec_cache, '\0', sizeof(retval->dec_cache));
+    retval->dec_clock = 0 ;
     tmp_m = NEW_GF_MATRIX(n, k);
     /*
      * fill the matrix with powers of field elements, starting from 0.
@@ -825,57 +1040,172 @@ build_decode_matrix(struct fec_parms *code, int index[])
 }
 
 /*
- * fec_decode receives as input a vector of packets, the indexes of
- * packets, and produces the correct vector as output.
- *
- * Input:
- *	code: pointer to code descriptor
- *	pkt:  pointers to received packets. They are modified
- *	      to store the output packets (in place)
- *	index: pointer to packet indexes (modified)
- *	sz:    size of each packet
+ * After shuffle() the parity packets sit in the slots of the missing data
+ * packets in the order they were received, although any order decodes.
+ * Sort them by index so that blocks which lost the same packets also use
+ * the same decode matrix.
  */
-int
-fec_decode(struct fec_parms *code, gf *pkt[], int index[], int sz)
+static void
+sort_parity(gf *pkt[], int index[], int k)
 {
+    int i, j ;
+
+    for (i = 0 ; i < k ; i++) {
+	if (index[i] < k)
+	    continue ;
+	for (j = i + 1 ; j < k ; j++) {
+	    if (index[j] >= k && index[j] < index[i]) {
+		SWAP(index[i], index[j], int) ;
+		SWAP(pkt[i], pkt[j], gf *) ;
+	    }
+	}
+    }
+}
+
+/*
+ * get_decode_matrix returns the decode matrix for the (shuffled) indexes,
+ * from the cache if possible. The matrix belongs to the cache and must not
+ * be freed by the caller.
+ */
+static gf *
+get_decode_matrix(struct fec_parms *code, int index[])
+{
+    struct dec_matrix *d, *victim = &code->dec_cache[0] ;
+    int i, k = code->k ;
     gf *m_dec ;
-    gf **new_pkt ;
-    int row, col , k = code->k ;
 
-    if (GF_BITS > 8)
-	sz /= 2 ;
+    code->dec_clock++ ;
+    for (i = 0 ; i < DEC_CACHE_SIZE ; i++) {
+	d = &code->dec_cache[i] ;
+	if (d->index == NULL) {
+	    victim = d ;
+	    break ;
+	}
+	if (!memcmp(d->index, index, k * sizeof(int))) {
+	    d->used = code->dec_clock ;
+	    return d->m_dec ;
+	}
+	if (victim->index != NULL && d->used < victim->used)
+	    victim = d ;
+    }
 
-    if (shuffle(pkt, index, k))	/* error if true */
-	return 1 ;
     m_dec = build_decode_matrix(code, index);
-
     if (m_dec == NULL)
-	return 1 ; /* error */
-    /*
-     * do the actual decoding
-     */
-    new_pkt = my_malloc (k * sizeof (gf * ), "new pkt pointers" );
-    for (row = 0 ; row < k ; row++ ) {
-	if (index[row] >= k) {
-	    new_pkt[row] = my_malloc (sz * sizeof (gf), "new pkt buffer" );
-	    memset(new_pkt[row], '\0', sz * sizeof(gf) ) ;
+	return NULL ;
+    if (victim->index == NULL)
+	victim->index = my_malloc(k * sizeof(int), "decode matrix index");
+    free(victim->m_dec);
+    memcpy(victim->index, index, k * sizeof(int));
+    victim->m_dec = m_dec ;
+    victim->used = code->dec_clock ;
+    return m_dec ;
+}
+
+/*
+ * decode_group decodes the nr blocks in pkts[], which all were shuffled
+ * into the same indexes, with the decode matrix m_dec. The blocks are
+ * done one after the other to keep each in the cache while it is worked
+ * on, sharing one buffer for the reconstructed packets.
+ */
+static void
+decode_group(struct fec_parms *code, gf *m_dec, gf **pkts[], int index[],
+	     int nr, int sz)
+{
+    gf *new_pkt, *p, **pkt ;
+    int row, col, b, missing = 0, k = code->k ;
+
+    for (row = 0 ; row < k ; row++ )
+	if (index[row] >= k)
+	    missing++ ;
+    new_pkt = my_malloc (missing * sz * sizeof (gf), "new pkt buffer" );
+
+    for (b = 0 ; b < nr ; b++) {
+	pkt = pkts[b] ;
+	memset(new_pkt, '\0', missing * sz * sizeof(gf) ) ;
+	/*
+	 * do the actual decoding
+	 */
+	for (row = 0, p = new_pkt ; row < k ; row++ ) {
+	    if (index[row] < k)
+		continue ;
 	    for (col = 0 ; col < k ; col++ )
-		addmul(new_pkt[row], pkt[col], m_dec[row*k + col], sz) ;
+		addmul(p, pkt[col], m_dec[row*k + col], sz) ;
+	    p += sz ;
 	}
-    }
-    /*
-     * move pkts to their final destination
-     */
-    for (row = 0 ; row < k ; row++ ) {
-	if (index[row] >= k) {
-	    memcpy(pkt[row], new_pkt[row], sz*sizeof(gf));
-	    free(new_pkt[row]);
+	/*
+	 * move pkts to their final destination
+	 */
+	for (row = 0, p = new_pkt ; row < k ; row++ ) {
+	    if (index[row] < k)
+		continue ;
+	    memcpy(pkt[row], p, sz*sizeof(gf));
+	    p += sz ;
 	}
     }
     free(new_pkt);
-    free(m_dec);
+}
 
-    return 0;
+/*
+ * fec_decode_batch decodes nr blocks in one go. pkts[b] and index[b] are
+ * the packets and indexes of block b, as for fec_decode(). Blocks which
+ * lost the same packets are decoded together with one decode matrix.
+ */
+int
+fec_decode_batch(struct fec_parms *code, gf **pkts[], int *index[], int nr,
+		 int sz)
+{
+    gf *m_dec, ***group ;
+    char *done ;
+    int b, i, cnt, k = code->k, err = 0 ;
+
+    if (GF_BITS > 8)
+	sz /= 2 ;
+
+    for (b = 0 ; b < nr ; b++) {
+	if (shuffle(pkts[b], index[b], k))	/* error if true */
+	    return 1 ;
+	sort_parity(pkts[b], index[b], k);
+    }
+
+    done = my_malloc(nr, "decoded blocks");
+    memset(done, '\0', nr);
+    group = my_malloc(nr * sizeof(gf **), "decode group");
+    for (b = 0 ; b < nr ; b++) {
+	if (done[b])
+	    continue ;
+	m_dec = get_decode_matrix(code, index[b]);
+	if (m_dec == NULL) {
+	    err = 1 ;
+	    break ;
+	}
+	for (i = b, cnt = 0 ; i < nr ; i++) {
+	    if (!done[i] && !memcmp(index[i], index[b], k * sizeof(int))) {
+		group[cnt++] = pkts[i] ;
+		done[i] = 1 ;
+	    }
+	}
+	decode_group(code, m_dec, group, index[b], cnt, sz);
+    }
+    free(group);
+    free(done);
+    return err ;
+}
+
+/*
+ * fec_decode receives as input a vector of packets, the indexes of
+ * packets, and produces the correct vector as output.
+ *
+ * Input:
+ *	code: pointer to code descriptor
+ *	pkt:  pointers to received packets. They are modified
+ *	      to store the output packets (in place)
+ *	index: pointer to packet indexes (modified)
+ *	sz:    size of each packet
+ */
+int
+fec_decode(struct fec_parms *code, gf *pkt[], int index[], int sz)
+{
+    return fec_decode_batch(code, &pkt, &index, 1, sz);
 }
 
 /*********** end of FEC code -- beginning of test code ************/
@@ -52,3 +52,14 @@ void fec_encode_linear(struct fec_parms *code, unsigned char *src,
  */
 int fec_decode(struct fec_parms *code, unsigned char *data[],
 	       int i[], int sz);
+
+/* pkts  - array of (nr) arrays of (k) pointers to data packets, one per block
+ * i     - array of (nr) arrays of indices, as for fec_decode()
+ * nr    - number of blocks
+ * sz    - data packet size
+ *
+ * Decodes (nr) blocks like fec_decode() does, but decodes the blocks which
+ * are missing the same packets together.
+ */
+int fec_decode_batch(struct fec_parms *code, unsigned char **pkts[],
+		     int *i[], int nr, int sz);
@@ -73,6 +73,7 @@
 #include <byteswap.h>
 #include <crc32.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "rbtree.h"
 #include "common.h"
@@ -98,7 +99,11 @@ struct filesystem_entry {
 	struct filesystem_entry *prev;	/* Only relevant to non-directories */
 	struct filesystem_entry *next;	/* Only relevant to non-directories */
 	struct filesystem_entry *files;	/* Only relevant to directories */
+	struct filesystem_entry *last_file;	/* Only relevant to directories */
+	struct filesystem_entry *hash_next;	/* Next in entry_hash bucket */
 	struct rb_node hardlink_rb;
+	struct filesystem_entry *compr_next;	/* Next file to compress ahead */
+	int compr_queued;			/* Compressed ahead by the workers */
 };
 
 struct rb_root hardlinks;
@@ -168,46 +173,65 @@ static FILE *xfopen(const char *path, const char *mode)
 	return fp;
 }
 
-static struct filesystem_entry *find_filesystem_entry(
-		struct filesystem_entry *dir, char *fullname, uint32_t type)
+/*
+ * All entries hashed by full name, so that device table lines are resolved
+ * without walking the tree. The table doubles when it gets as many entries
+ * as buckets.
+ */
+static struct filesystem_entry **entry_hash;
+static unsigned int entry_hash_size;
+static unsigned int entry_hash_count;
+
+static unsigned int entry_hash_index(const char *fullname, unsigned int size)
 {
-	struct filesystem_entry *e = dir;
+	return mtd_crc32(0, fullname, strlen(fullname)) & (size - 1);
+}
 
-	if (S_ISDIR(dir->sb.st_mode)) {
-		/* If this is the first call, and we actually want this
-		 * directory, then return it now */
+static struct filesystem_entry *find_filesystem_entry(const char *fullname)
+{
+	struct filesystem_entry *e;
+
+	if (!entry_hash)
+		return NULL;
+
+	e = entry_hash[entry_hash_index(fullname, entry_hash_size)];
+	for (; e; e = e->hash_next) {
 		if (strcmp(fullname, e->fullname) == 0)
 			return e;
-
-		e = dir->files;
 	}
-	while (e) {
-		if (S_ISDIR(e->sb.st_mode)) {
-			int len = strlen(e->fullname);
+	return NULL;
+}
 
-			/* Check if we are a parent of the correct path */
-			if (strncmp(e->fullname, fullname, len) == 0) {
-				/* Is this an _exact_ match? */
-				if (strcmp(fullname, e->fullname) == 0) {
-					return (e);
-				}
-				/* Looks like we found a parent of the correct path */
-				if (fullname[len] == '/') {
-					if (e->files) {
-						return (find_filesystem_entry (e, fullname, type));
-					} else {
-						return NULL;
-					}
-				}
-			}
-		} else {
-			if (strcmp(fullname, e->fullname) == 0) {
-				return (e);
+static void hash_filesystem_entry(struct filesystem_entry *entry)
+{
+	struct filesystem_entry **new_hash, *e, *next;
+	unsigned int i, index, new_size;
+
+	/* Keep the first of several entries by the same name, like the
+	 * tree walk did */
+	if (find_filesystem_entry(entry->fullname))
+		return;
+
+	if (entry_hash_count >= entry_hash_size) {
+		new_size = entry_hash_size ? entry_hash_size * 2 : 1024;
+		new_hash = xcalloc(new_size, sizeof(*new_hash));
+		for (i = 0; i < entry_hash_size; i++) {
+			for (e = entry_hash[i]; e; e = next) {
+				next = e->hash_next;
+				index = entry_hash_index(e->fullname, new_size);
+				e->hash_next = new_hash[index];
+				new_hash[index] = e;
 			}
 		}
-		e = e->next;
+		free(entry_hash);
+		entry_hash = new_hash;
+		entry_hash_size = new_size;
 	}
-	return (NULL);
+
+	index = entry_hash_index(entry->fullname, entry_hash_size);
+	entry->hash_next = entry_hash[index];
+	entry_hash[index] = entry;
+	entry_hash_count++;
 }
 
 static struct filesystem_entry *add_host_filesystem_entry(const char *name,
@@ -283,6 +307,8 @@ static struct filesystem_entry *add_host_filesystem_entry(const char *name,
 		entry->sb.st_size = strlen(entry->link);
 	}
 
+	hash_filesystem_entry(entry);
+
 	/* This happens only for root */
 	if (!parent)
 		return (entry);
@@ -292,11 +318,10 @@ static struct filesystem_entry *add_host_filesystem_entry(const char *name,
 	if (!parent->files) {
 		parent->files = entry;
 	} else {
-		struct filesystem_entry *prev;
-		for (prev = parent->files; prev->next; prev = prev->next);
-		prev->next = entry;
-		entry->prev = prev;
+		parent->last_file->next = entry;
+		entry->prev = parent->last_file;
 	}
+	parent->last_file = entry;
 
 	return (entry);
 }
@@ -413,7 +438,7 @@ inline int snprintf(char *str, size_t n, const char *fmt, ...)
 	Regular files must exist in the target root directory.  If a char,
 	block, fifo, or directory does not exist, it will be created.
  */
-static int interpret_table_entry(struct filesystem_entry *root, char *line)
+static int interpret_table_entry(char *line)
 {
 	char *hostpath;
 	char type, *name = NULL, *tmp, *dir;
@@ -457,7 +482,7 @@ static int interpret_table_entry(struct filesystem_entry *root, char *line)
 		default:
 			errmsg_die("Unsupported file type '%c'", type);
 	}
-	entry = find_filesystem_entry(root, name, mode);
+	entry = find_filesystem_entry(name);
 	if (entry && !(count > 0 && (type == 'c' || type == 'b'))) {
 		/* Ok, we just need to fixup the existing entry
 		 * and we will be all done... */
@@ -472,7 +497,7 @@ static int interpret_table_entry(struct filesystem_entry *root, char *line)
 		 * try and find our parent now) */
 		tmp = strdup(name);
 		dir = dirname(tmp);
-		parent = find_filesystem_entry(root, dir, S_IFDIR);
+		parent = find_filesystem_entry(dir);
 		free(tmp);
 		if (parent == NULL) {
 			errmsg ("skipping device_table entry '%s': no parent directory!", name);
@@ -522,7 +547,7 @@ static int interpret_table_entry(struct filesystem_entry *root, char *line)
 	return 0;
 }
 
-static int parse_device_table(struct filesystem_entry *root, FILE * file)
+static int parse_device_table(FILE * file)
 {
 	char *line;
 	int status = 0;
@@ -554,7 +579,7 @@ static int parse_device_table(struct filesystem_entry *root, FILE * file)
 
 		/* If this is NOT a comment line, try to interpret it */
 		if (len && *line != '#') {
-			if (interpret_table_entry(root, line))
+			if (interpret_table_entry(line))
 				status = 1;
 		}
 
@@ -608,15 +633,15 @@ static int pad_fs_size = 0;
 static int add_cleanmarkers = 1;
 static struct jffs2_unknown_node cleanmarker;
 static int cleanmarker_size = sizeof(cleanmarker);
-static unsigned char ffbuf[16] =
-{ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	0xff, 0xff, 0xff, 0xff, 0xff
-};
 
 /* We set this at start of main() using sysconf(), -1 means we don't know */
 /* When building an fs for non-native systems, use --pagesize=SIZE option */
 int page_size = -1;
 
+/* A page of file data and the same compressed, for the serial code */
+static unsigned char *page_buf;
+static unsigned char *compr_buf;
+
 #include "compr.h"
 
 static void full_write(int fd, const void *buf, int len)
@@ -634,35 +659,85 @@ static void full_write(int fd, const void *buf, int len)
 
 		len -= ret;
 		buf += ret;
-		out_ofs += ret;
 	}
 }
 
-static void padblock(void)
+/*
+ * The image is assembled an eraseblock at a time in out_buf and written
+ * with one write() per eraseblock, rather than a few small ones per node.
+ * out_ofs counts the bytes written so far, including those still in the
+ * buffer. With --direct-io the output bypasses the page cache; the last,
+ * partial eraseblock is written without O_DIRECT.
+ */
+static unsigned char *out_buf;
+static int out_buf_len;
+static int direct_io = 0;
+
+static void out_flush(void)
+{
+	if (!out_buf_len)
+		return;
+
+	if (direct_io && out_buf_len < erase_block_size) {
+		if (fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) & ~O_DIRECT))
+			sys_errmsg_die("fcntl");
+		direct_io = 0;
+	}
+	full_write(out_fd, out_buf, out_buf_len);
+	out_buf_len = 0;
+}
+
+static unsigned char *out_space(int *len)
 {
-	while (out_ofs % erase_block_size) {
-		full_write(out_fd, ffbuf, min(sizeof(ffbuf),
-					erase_block_size - (out_ofs % erase_block_size)));
+	if (!out_buf) {
+		/* O_DIRECT wants the buffer aligned too */
+		if (posix_memalign((void **)&out_buf, 4096, erase_block_size))
+			errmsg_die("cannot allocate %d bytes of memory", erase_block_size);
+	}
+	if (out_buf_len == erase_block_size)
+		out_flush();
+	if (*len > erase_block_size - out_buf_len)
+		*len = erase_block_size - out_buf_len;
+	return out_buf + out_buf_len;
+}
+
+static void out_write(const void *buf, int len)
+{
+	while (len > 0) {
+		int n = len;
+		unsigned char *p = out_space(&n);
+
+		memcpy(p, buf, n);
+		out_buf_len += n;
+		out_ofs += n;
+		buf += n;
+		len -= n;
 	}
 }
 
 static void pad(int req)
 {
-	while (req) {
-		if (req > sizeof(ffbuf)) {
-			full_write(out_fd, ffbuf, sizeof(ffbuf));
-			req -= sizeof(ffbuf);
-		} else {
-			full_write(out_fd, ffbuf, req);
-			req = 0;
-		}
+	while (req > 0) {
+		int n = req;
+		unsigned char *p = out_space(&n);
+
+		memset(p, 0xff, n);
+		out_buf_len += n;
+		out_ofs += n;
+		req -= n;
 	}
 }
 
+static void padblock(void)
+{
+	if (out_ofs % erase_block_size)
+		pad(erase_block_size - (out_ofs % erase_block_size));
+}
+
 static inline void padword(void)
 {
 	if (out_ofs % 4) {
-		full_write(out_fd, ffbuf, 4 - (out_ofs % 4));
+		pad(4 - (out_ofs % 4));
 	}
 }
 
@@ -670,7 +745,7 @@ static inline void pad_block_if_less_than(int req)
 {
 	if (add_cleanmarkers) {
 		if ((out_ofs % erase_block_size) == 0) {
-			full_write(out_fd, &cleanmarker, sizeof(cleanmarker));
+			out_write(&cleanmarker, sizeof(cleanmarker));
 			pad(cleanmarker_size - sizeof(cleanmarker));
 			padword();
 		}
@@ -680,7 +755,7 @@ static inline void pad_block_if_less_than(int req)
 	}
 	if (add_cleanmarkers) {
 		if ((out_ofs % erase_block_size) == 0) {
-			full_write(out_fd, &cleanmarker, sizeof(cleanmarker));
+			out_write(&cleanmarker, sizeof(cleanmarker));
 			pad(cleanmarker_size - sizeof(cleanmarker));
 			padword();
 		}
@@ -713,17 +788,326 @@ static void write_dirent(struct filesystem_entry *e)
 	rd.name_crc = cpu_to_je32(mtd_crc32(0, name, strlen(name)));
 
 	pad_block_if_less_than(sizeof(rd) + rd.nsize);
-	full_write(out_fd, &rd, sizeof(rd));
-	full_write(out_fd, name, rd.nsize);
+	out_write(&rd, sizeof(rd));
+	out_write(name, rd.nsize);
 	padword();
 }
 
+/*
+ * Parallel compression.
+ *
+ * Where a data node is placed, and so how much room its compressor gets,
+ * depends on everything written before it, so the image has to be laid
+ * out serially. The expensive part can run ahead though: worker threads
+ * read regular files in segments of SEGMENT_PAGES pages, in the order
+ * recursive_populate_directory() will write them, and compress each page
+ * as if it had a whole page of room. write_regular_file() uses such a
+ * result whenever the uncompressed page would fit in the rest of the
+ * eraseblock, which is exactly when the serial code would have made the
+ * same call; otherwise (the page straddling an eraseblock boundary, and
+ * the rest of a page which got split) it compresses inline as before.
+ * The image is therefore the same whatever the number of jobs.
+ */
+#define SEGMENT_PAGES		64
+#define SEGMENTS_PER_JOB	4
+
+struct compr_page {
+	unsigned char *cbuf;	/* compressed data (in the segment's cdata) */
+	uint32_t dsize;		/* amount of data compressed */
+	uint32_t csize;		/* size of the compressed data */
+	uint16_t compression;
+};
+
+struct compr_segment {
+	struct filesystem_entry *e;
+	off_t offset;		/* in the file */
+	int len;		/* bytes read, -1 if the file can't be opened */
+	int err;		/* errno if reading the file failed */
+	int done;
+	unsigned char *data;
+	unsigned char *cdata;	/* room for each page compressed */
+	struct compr_segment *next;
+	struct compr_page pages[SEGMENT_PAGES];
+};
+
+static int nr_jobs = 1;
+static pthread_t *compr_threads;
+static pthread_mutex_t compr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compr_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t compr_done_cond = PTHREAD_COND_INITIALIZER;
+static struct filesystem_entry *compr_file;	/* next file to segment */
+static off_t compr_offset;			/* and where in it */
+static struct compr_segment *compr_head, *compr_tail, *compr_free;
+static int compr_segments;			/* segments in flight */
+static int compr_stop;
+
+static void compress_segment(struct compr_segment *seg)
+{
+	int fd, i, ret, pos, len;
+
+	len = min((off_t) SEGMENT_PAGES * page_size,
+			seg->e->sb.st_size - seg->offset);
+
+	fd = open(seg->e->hostname, O_RDONLY);
+	if (fd == -1) {
+		seg->err = errno;
+		seg->len = -1;
+		return;
+	}
+	for (pos = 0; pos < len; pos += ret) {
+		ret = pread(fd, seg->data + pos, len - pos, seg->offset + pos);
+		if (ret < 0) {
+			seg->err = errno;
+			close(fd);
+			return;
+		}
+		if (ret == 0)
+			break;
+	}
+	close(fd);
+	seg->len = pos;
+
+	for (i = 0; i * page_size < seg->len; i++) {
+		struct compr_page *page = &seg->pages[i];
+
+		page->cbuf = seg->cdata + i * JFFS2_COMPR_BUF_SIZE(page_size);
+		page->dsize = min(page_size, seg->len - i * page_size);
+		page->csize = page->dsize;
+		page->compression = jffs2_compress_nostat(
+				seg->data + i * page_size, page->cbuf,
+				&page->dsize, &page->csize);
+	}
+}
+
+static void *compr_worker(void *arg)
+{
+	struct compr_segment *seg;
+
+	pthread_mutex_lock(&compr_mutex);
+	while (1) {
+		while (!compr_stop && (!compr_file ||
+				compr_segments >= nr_jobs * SEGMENTS_PER_JOB))
+			pthread_cond_wait(&compr_work_cond, &compr_mutex);
+		if (compr_stop)
+			break;
+
+		seg = compr_free;
+		if (seg) {
+			compr_free = seg->next;
+		} else {
+			seg = xmalloc(sizeof(*seg));
+			seg->data = xmalloc(SEGMENT_PAGES * page_size);
+			seg->cdata = xmalloc(SEGMENT_PAGES *
+					JFFS2_COMPR_BUF_SIZE(page_size));
+		}
+		seg->e = compr_file;
+		seg->offset = compr_offset;
+		seg->len = 0;
+		seg->err = 0;
+		seg->done = 0;
+		seg->next = NULL;
+
+		compr_offset += SEGMENT_PAGES * page_size;
+		if (compr_offset >= compr_file->sb.st_size) {
+			compr_file = compr_file->compr_next;
+			compr_offset = 0;
+		}
+		if (compr_tail)
+			compr_tail->next = seg;
+		else
+			compr_head = seg;
+		compr_tail = seg;
+		compr_segments++;
+		pthread_mutex_unlock(&compr_mutex);
+
+		compress_segment(seg);
+
+		pthread_mutex_lock(&compr_mutex);
+		seg->done = 1;
+		if (seg == compr_head)
+			pthread_cond_signal(&compr_done_cond);
+	}
+	pthread_mutex_unlock(&compr_mutex);
+	return arg;
+}
+
+/* Called with compr_mutex held */
+static void release_segment(struct compr_segment *seg)
+{
+	compr_head = seg->next;
+	if (!compr_head)
+		compr_tail = NULL;
+	seg->next = compr_free;
+	compr_free = seg;
+	compr_segments--;
+	pthread_cond_signal(&compr_work_cond);
+}
+
+/* Wait for the next segment of @e to be compressed */
+static struct compr_segment *get_segment(struct filesystem_entry *e)
+{
+	struct compr_segment *seg;
+
+	pthread_mutex_lock(&compr_mutex);
+	while (1) {
+		while (!compr_head || !compr_head->done)
+			pthread_cond_wait(&compr_done_cond, &compr_mutex);
+		seg = compr_head;
+		if (seg->e == e)
+			break;
+		/* A file which wasn't written after all, e.g. a hard link */
+		release_segment(seg);
+	}
+	pthread_mutex_unlock(&compr_mutex);
+	return seg;
+}
+
+static void put_segment(struct compr_segment *seg)
+{
+	pthread_mutex_lock(&compr_mutex);
+	release_segment(seg);
+	pthread_mutex_unlock(&compr_mutex);
+}
+
+/* Queue regular files in the order recursive_populate_directory() writes them */
+static struct filesystem_entry **queue_files(struct filesystem_entry *dir,
+		struct filesystem_entry **tail)
+{
+	struct filesystem_entry *e;
+
+	for (e = dir->files; e; e = e->next) {
+		/* Only the first of several links gets written */
+		if (!S_ISREG(e->sb.st_mode) || e->sb.st_nlink > 1 ||
+		    !e->sb.st_size || e->sb.st_size >= JFFS2_MAX_FILE_SIZE)
+			continue;
+		e->compr_queued = 1;
+		*tail = e;
+		tail = &e->compr_next;
+	}
+	for (e = dir->files; e; e = e->next) {
+		if (S_ISDIR(e->sb.st_mode) && e->files)
+			tail = queue_files(e, tail);
+	}
+	return tail;
+}
+
+static void start_compr_workers(struct filesystem_entry *root)
+{
+	int i, ret;
+
+	*queue_files(root, &compr_file) = NULL;
+	compr_offset = 0;
+
+	compr_threads = xmalloc(nr_jobs * sizeof(*compr_threads));
+	for (i = 0; i < nr_jobs; i++) {
+		ret = pthread_create(&compr_threads[i], NULL, compr_worker, NULL);
+		if (ret) {
+			errno = ret;
+			sys_errmsg_die("pthread_create");
+		}
+	}
+}
+
+static void stop_compr_workers(void)
+{
+	struct compr_segment *seg;
+	int i;
+
+	pthread_mutex_lock(&compr_mutex);
+	compr_stop = 1;
+	pthread_cond_broadcast(&compr_work_cond);
+	pthread_mutex_unlock(&compr_mutex);
+
+	for (i = 0; i < nr_jobs; i++)
+		pthread_join(compr_threads[i], NULL);
+	free(compr_threads);
+
+	while (compr_head)
+		release_segment(compr_head);
+	while ((seg = compr_free)) {
+		compr_free = seg->next;
+		free(seg->data);
+		free(seg->cdata);
+		free(seg);
+	}
+}
+
+/*
+ * Write the data nodes for @len bytes at @tbuf, a page of a regular file.
+ * @pre is that page compressed ahead of time, or NULL.
+ */
+static unsigned int write_page(struct jffs2_raw_inode *ri, uint32_t *ver,
+		unsigned int *offset, unsigned char *tbuf, int len,
+		struct compr_page *pre)
+{
+	unsigned char *cbuf, *wbuf;
+	unsigned int totcomp = 0;
+
+	while (len) {
+		uint32_t dsize, space;
+		uint16_t compression;
+
+		pad_block_if_less_than(sizeof(*ri) + JFFS2_MIN_DATA_LEN);
+
+		dsize = len;
+		space =
+			erase_block_size - (out_ofs % erase_block_size) -
+			sizeof(*ri);
+		if (pre && space >= dsize) {
+			/* The very call compress_segment() has made */
+			compression = pre->compression;
+			cbuf = pre->cbuf;
+			dsize = pre->dsize;
+			space = pre->csize;
+			jffs2_compress_account(compression, dsize, space);
+		} else {
+			if (space > dsize)
+				space = dsize;
+
+			cbuf = compr_buf;
+			compression = jffs2_compress(tbuf, cbuf, &dsize, &space);
+		}
+		pre = NULL;
+
+		ri->compr = compression & 0xff;
+		ri->usercompr = (compression >> 8) & 0xff;
+
+		if (ri->compr) {
+			wbuf = cbuf;
+		} else {
+			wbuf = tbuf;
+			dsize = space;
+		}
+
+		ri->totlen = cpu_to_je32(sizeof(*ri) + space);
+		ri->hdr_crc = cpu_to_je32(mtd_crc32(0,
+					ri, sizeof(struct jffs2_unknown_node) - 4));
+
+		ri->version = cpu_to_je32(++(*ver));
+		ri->offset = cpu_to_je32(*offset);
+		ri->csize = cpu_to_je32(space);
+		ri->dsize = cpu_to_je32(dsize);
+		ri->node_crc = cpu_to_je32(mtd_crc32(0, ri, sizeof(*ri) - 8));
+		ri->data_crc = cpu_to_je32(mtd_crc32(0, wbuf, space));
+
+		out_write(ri, sizeof(*ri));
+		totcomp += sizeof(*ri);
+		out_write(wbuf, space);
+		totcomp += space;
+		padword();
+
+		tbuf += dsize;
+		len -= dsize;
+		*offset += dsize;
+	}
+	return totcomp;
+}
+
 static unsigned int write_regular_file(struct filesystem_entry *e)
 {
-	int fd, len;
+	int fd = -1, len, i;
 	uint32_t ver;
 	unsigned int offset;
-	unsigned char *buf, *cbuf, *wbuf;
 	struct jffs2_raw_inode ri;
 	struct stat *statbuf;
 	unsigned int totcomp = 0;
@@ -733,9 +1117,11 @@ static unsigned int write_regular_file(struct filesystem_entry *e)
 		errmsg("Skipping file \"%s\" too large.", e->path);
 		return -1;
 	}
-	fd = open(e->hostname, O_RDONLY);
-	if (fd == -1) {
-		sys_errmsg_die("%s: open file", e->hostname);
+	if (!e->compr_queued) {
+		fd = open(e->hostname, O_RDONLY);
+		if (fd == -1) {
+			sys_errmsg_die("%s: open file", e->hostname);
+		}
 	}
 
 	e->ino = ++ino;
@@ -744,9 +1130,6 @@ static unsigned int write_regular_file(struct filesystem_entry *e)
 			(unsigned long) e->parent->ino);
 	write_dirent(e);
 
-	buf = xmalloc(page_size);
-	cbuf = NULL;
-
 	ver = 0;
 	offset = 0;
 
@@ -763,64 +1146,33 @@ static unsigned int write_regular_file(struct filesystem_entry *e)
 	ri.mtime = cpu_to_je32(statbuf->st_mtime);
 	ri.isize = cpu_to_je32(statbuf->st_size);
 
-	while ((len = read(fd, buf, page_size))) {
-		unsigned char *tbuf = buf;
-
-		if (len < 0) {
-			sys_errmsg_die("read");
-		}
-
-		while (len) {
-			uint32_t dsize, space;
-			uint16_t compression;
-
-			pad_block_if_less_than(sizeof(ri) + JFFS2_MIN_DATA_LEN);
-
-			dsize = len;
-			space =
-				erase_block_size - (out_ofs % erase_block_size) -
-				sizeof(ri);
-			if (space > dsize)
-				space = dsize;
-
-			compression = jffs2_compress(tbuf, &cbuf, &dsize, &space);
+	if (e->compr_queued) {
+		off_t seg_ofs;
 
-			ri.compr = compression & 0xff;
-			ri.usercompr = (compression >> 8) & 0xff;
+		for (seg_ofs = 0; seg_ofs < statbuf->st_size;
+				seg_ofs += SEGMENT_PAGES * page_size) {
+			struct compr_segment *seg = get_segment(e);
 
-			if (ri.compr) {
-				wbuf = cbuf;
-			} else {
-				wbuf = tbuf;
-				dsize = space;
+			if (seg->err) {
+				errno = seg->err;
+				if (seg->len < 0)
+					sys_errmsg_die("%s: open file", e->hostname);
+				sys_errmsg_die("read");
 			}
-
-			ri.totlen = cpu_to_je32(sizeof(ri) + space);
-			ri.hdr_crc = cpu_to_je32(mtd_crc32(0,
-						&ri, sizeof(struct jffs2_unknown_node) - 4));
-
-			ri.version = cpu_to_je32(++ver);
-			ri.offset = cpu_to_je32(offset);
-			ri.csize = cpu_to_je32(space);
-			ri.dsize = cpu_to_je32(dsize);
-			ri.node_crc = cpu_to_je32(mtd_crc32(0, &ri, sizeof(ri) - 8));
-			ri.data_crc = cpu_to_je32(mtd_crc32(0, wbuf, space));
-
-			full_write(out_fd, &ri, sizeof(ri));
-			totcomp += sizeof(ri);
-			full_write(out_fd, wbuf, space);
-			totcomp += space;
-			padword();
-
-			if (tbuf != cbuf) {
-				free(cbuf);
-				cbuf = NULL;
+			for (i = 0; i * page_size < seg->len; i++) {
+				len = min(page_size, seg->len - i * page_size);
+				totcomp += write_page(&ri, &ver, &offset,
+						seg->data + i * page_size, len,
+						&seg->pages[i]);
 			}
-
-			tbuf += dsize;
-			len -= dsize;
-			offset += dsize;
-
+			put_segment(seg);
+		}
+	} else {
+		while ((len = read(fd, page_buf, page_size))) {
+			if (len < 0) {
+				sys_errmsg_die("read");
+			}
+			totcomp += write_page(&ri, &ver, &offset, page_buf, len, NULL);
 		}
 	}
 	if (!je32_to_cpu(ri.version)) {
@@ -835,11 +1187,11 @@ static unsigned int write_regular_file(struct filesystem_entry *e)
 		ri.dsize = cpu_to_je32(0);
 		ri.node_crc = cpu_to_je32(mtd_crc32(0, &ri, sizeof(ri) - 8));
 
-		full_write(out_fd, &ri, sizeof(ri));
+		out_write(&ri, sizeof(ri));
 		padword();
 	}
-	free(buf);
-	close(fd);
+	if (fd != -1)
+		close(fd);
 	return totcomp;
 }
 
@@ -886,8 +1238,8 @@ static void write_symlink(struct filesystem_entry *e)
 	ri.data_crc = cpu_to_je32(mtd_crc32(0, e->link, len));
 
 	pad_block_if_less_than(sizeof(ri) + len);
-	full_write(out_fd, &ri, sizeof(ri));
-	full_write(out_fd, e->link, len);
+	out_write(&ri, sizeof(ri));
+	out_write(e->link, len);
 	padword();
 }
 
@@ -928,7 +1280,7 @@ static void write_pipe(struct filesystem_entry *e)
 	ri.data_crc = cpu_to_je32(0);
 
 	pad_block_if_less_than(sizeof(ri));
-	full_write(out_fd, &ri, sizeof(ri));
+	out_write(&ri, sizeof(ri));
 	padword();
 }
 
@@ -968,8 +1320,8 @@ static void write_special_file(struct filesystem_entry *e)
 	ri.data_crc = cpu_to_je32(mtd_crc32(0, &kdev, sizeof(kdev)));
 
 	pad_block_if_less_than(sizeof(ri) + sizeof(kdev));
-	full_write(out_fd, &ri, sizeof(ri));
-	full_write(out_fd, &kdev, sizeof(kdev));
+	out_write(&ri, sizeof(ri));
+	out_write(&kdev, sizeof(kdev));
 	padword();
 }
 
@@ -1089,8 +1441,8 @@ static xattr_entry_t *create_xattr_entry(int xprefix, char *xname, char *xvalue,
 	rx.node_crc = cpu_to_je32(mtd_crc32(0, &rx, sizeof(rx) - 4));
 
 	pad_block_if_less_than(sizeof(rx) + xe->name_len + 1 + xe->value_len);
-	full_write(out_fd, &rx, sizeof(rx));
-	full_write(out_fd, xe->xname, xe->name_len + 1 + xe->value_len);
+	out_write(&rx, sizeof(rx));
+	out_write(xe->xname, xe->name_len + 1 + xe->value_len);
 	padword();
 
 	return xe;
@@ -1199,7 +1551,7 @@ static void write_xattr_entry(struct filesystem_entry *e)
 		ref.node_crc = cpu_to_je32(mtd_crc32(0, &ref, sizeof(ref) - 4));
 
 		pad_block_if_less_than(sizeof(ref));
-		full_write(out_fd, &ref, sizeof(ref));
+		out_write(&ref, sizeof(ref));
 		padword();
 	}
 }
@@ -1330,7 +1682,15 @@ static void create_target_filesystem(struct filesystem_entry *root)
 		ino = 1;
 
 	root->ino = 1;
+	page_buf = xmalloc(page_size);
+	compr_buf = xmalloc(JFFS2_COMPR_BUF_SIZE(page_size));
+	if (nr_jobs > 1)
+		start_compr_workers(root);
 	recursive_populate_directory(root);
+	if (nr_jobs > 1)
+		stop_compr_workers();
+	free(compr_buf);
+	free(page_buf);
 
 	if (pad_fs_size == -1) {
 		padblock();
@@ -1338,17 +1698,17 @@ static void create_target_filesystem(struct filesystem_entry *root)
 		if (pad_fs_size && add_cleanmarkers){
 			padblock();
 			while (out_ofs < pad_fs_size) {
-				full_write(out_fd, &cleanmarker, sizeof(cleanmarker));
+				out_write(&cleanmarker, sizeof(cleanmarker));
 				pad(cleanmarker_size - sizeof(cleanmarker));
 				padblock();
 			}
 		} else {
-			while (out_ofs < pad_fs_size) {
-				full_write(out_fd, ffbuf, min(sizeof(ffbuf), pad_fs_size - out_ofs));
-			}
-
+			if (out_ofs < pad_fs_size)
+				pad(pad_fs_size - out_ofs);
 		}
 	}
+	out_flush();
+	free(out_buf);
 }
 
 static struct option long_options[] = {
@@ -1375,6 +1735,9 @@ static struct option long_options[] = {
 	{"test-compression", 0, NULL, 't'},
 	{"compressor-priority", 1, NULL, 'y'},
 	{"incremental", 1, NULL, 'i'},
+	{"jobs", 1, NULL, 'j'},
+	{"compression-cutoff", 1, NULL, 1003},
+	{"direct-io", 0, NULL, 1004},
 #ifndef WITHOUT_XATTR
 	{"with-xattr", 0, NULL, 1000 },
 	{"with-selinux", 0, NULL, 1001 },
@@ -1403,10 +1766,16 @@ static const char helptext[] =
 "                          Enable a compressor\n"
 "  -y, --compressor-priority=PRIORITY:COMPRESSOR_NAME\n"
 "                          Set the priority of a compressor\n"
+"      --compression-cutoff=PERCENT\n"
+"                          In size and favourlzo modes, take the first\n"
+"                          compressor (by priority) which gets a page down\n"
+"                          to PERCENT of its size\n"
 "  -L, --list-compressors  Show the list of the avaiable compressors\n"
 "  -t, --test-compression  Call decompress and compare with the original (for test)\n"
+"  -j, --jobs=N            Compress with N threads (default: number of CPUs)\n"
 "  -n, --no-cleanmarkers   Don't add a cleanmarker to every eraseblock\n"
 "  -o, --output=FILE       Output to FILE (default: stdout)\n"
+"      --direct-io         Write the output with O_DIRECT\n"
 "  -l, --little-endian     Create a little-endian filesystem\n"
 "  -b, --big-endian        Create a big-endian filesystem\n"
 "  -D, --devtable=FILE     Use the named FILE as a device table file\n"
@@ -1572,10 +1941,14 @@ int main(int argc, char **argv)
 	if (page_size != 4096)
 		warn_page_size = 1; /* warn user if page size not 4096 */
 
+	nr_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_jobs < 1)
+		nr_jobs = 1;
+
 	jffs2_compressors_init();
 
 	while ((opt = getopt_long(argc, argv,
-					"D:d:r:s:o:qUPfh?vVe:lbp::nc:m:x:X:Lty:i:", long_options, &c)) >= 0)
+					"D:d:r:s:o:qUPfh?vVe:lbp::nc:m:x:X:Lty:i:j:", long_options, &c)) >= 0)
 	{
 		switch (opt) {
 			case 'D':
@@ -1737,6 +2110,22 @@ int main(int argc, char **argv)
 						  sys_errmsg_die("cannot open (incremental) file");
 					  }
 					  break;
+			case 'j':
+					  nr_jobs = strtol(optarg, NULL, 0);
+					  if (nr_jobs < 1)
+						  errmsg_die("Bad number of jobs %s", optarg);
+					  break;
+			case 1003: {	/* --compression-cutoff */
+					  int cutoff = strtol(optarg, NULL, 0);
+
+					  if (cutoff < 0 || cutoff > 100)
+						  errmsg_die("Bad compression cutoff %s", optarg);
+					  jffs2_set_compression_cutoff(cutoff);
+					  break;
+				  }
+			case 1004:	/* --direct-io */
+					  direct_io = 1;
+					  break;
 #ifndef WITHOUT_XATTR
 			case 1000:	/* --with-xattr  */
 					  enable_xattr |= (1 << JFFS2_XPREFIX_USER)
@@ -1765,6 +2154,17 @@ int main(int argc, char **argv)
 		}
 		out_fd = 1;
 	}
+	if (direct_io) {
+		if (erase_block_size % 4096)
+			errmsg_die("--direct-io needs an erase block size multiple of 4KiB");
+		/* O_DIRECT on a pipe turns it into packet mode */
+		if (fstat(out_fd, &sb))
+			sys_errmsg_die("cannot stat the output");
+		if (!S_ISREG(sb.st_mode) && !S_ISBLK(sb.st_mode))
+			errmsg_die("--direct-io needs a regular file or block device output");
+		if (fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_DIRECT))
+			sys_errmsg_die("cannot use O_DIRECT for the output");
+	}
 	if (lstat(rootdir, &sb)) {
 		sys_errmsg_die("%s", rootdir);
 	}
@@ -1780,11 +2180,12 @@ int main(int argc, char **argv)
 	root = recursive_add_host_directory(NULL, "/", cwd);
 
 	if (devtable)
-		parse_device_table(root, devtable);
+		parse_device_table(devtable);
 
 	create_target_filesystem(root);
 
 	cleanup(root);
+	free(entry_hash);
 
 	if (rootdir != default_rootdir)
 		free(rootdir);
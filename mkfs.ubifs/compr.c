@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
 #include <lzo/lzo1x.h>
 #include <linux/types.h>
 
@@ -35,69 +36,81 @@
 #include "ubifs-media.h"
 #include "mkfs.ubifs.h"
 
-static void *lzo_mem;
+/**
+ * struct compr_ctx - compressor context.
+ * @lzo_compr: LZO compressor function corresponding to the compression level
+ * @lzo_mem: LZO work memory
+ * @zlib_buf: zlib output buffer used by favor LZO compression
+ * @strm: zlib deflate stream, it is initialized once and reset for every
+ *        block
+ * @errcnt: count of compression errors
+ * @lzo_skipped: count of blocks favor LZO compression skipped LZO for
+ *
+ * A compression context contains all the state the compressors need, so that
+ * several threads may compress data concurrently, each using its own context.
+ */
+struct compr_ctx {
+	lzo_compress_t lzo_compr;
+	void *lzo_mem;
+	char *zlib_buf;
+	z_stream strm;
+	unsigned long long errcnt;
+	unsigned long long lzo_skipped;
+};
+
 static unsigned long long errcnt = 0;
+static unsigned long long lzo_skipped = 0;
 static struct ubifs_info *c = &info_;
 
-#define DEFLATE_DEF_LEVEL     Z_DEFAULT_COMPRESSION
 #define DEFLATE_DEF_WINBITS   11
 #define DEFLATE_DEF_MEMLEVEL  8
 
-static int zlib_deflate(void *in_buf, size_t in_len, void *out_buf,
-			size_t *out_len)
-{
-	z_stream strm;
+/*
+ * Data with order-0 entropy above this many bits per byte are considered to be
+ * incompressible by the favor LZO pre-check.
+ */
+#define PRECHECK_ENTROPY 7.0
 
-	strm.zalloc = NULL;
-	strm.zfree = NULL;
+static int zlib_deflate(struct compr_ctx *ctx, void *in_buf, size_t in_len,
+			void *out_buf, size_t *out_len)
+{
+	z_stream *strm = &ctx->strm;
 
-	/*
-	 * Match exactly the zlib parameters used by the Linux kernel crypto
-	 * API.
-	 */
-        if (deflateInit2(&strm, DEFLATE_DEF_LEVEL, Z_DEFLATED,
-			 -DEFLATE_DEF_WINBITS, DEFLATE_DEF_MEMLEVEL,
-			 Z_DEFAULT_STRATEGY)) {
-		errcnt += 1;
+	if (deflateReset(strm) != Z_OK) {
+		ctx->errcnt += 1;
 		return -1;
 	}
 
-	strm.next_in = in_buf;
-	strm.avail_in = in_len;
-	strm.total_in = 0;
+	strm->next_in = in_buf;
+	strm->avail_in = in_len;
+	strm->total_in = 0;
 
-	strm.next_out = out_buf;
-	strm.avail_out = *out_len;
-	strm.total_out = 0;
+	strm->next_out = out_buf;
+	strm->avail_out = *out_len;
+	strm->total_out = 0;
 
-	if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
-		deflateEnd(&strm);
-		errcnt += 1;
+	if (deflate(strm, Z_FINISH) != Z_STREAM_END) {
+		ctx->errcnt += 1;
 		return -1;
 	}
 
-	if (deflateEnd(&strm) != Z_OK) {
-		errcnt += 1;
-		return -1;
-	}
-
-	*out_len = strm.total_out;
+	*out_len = strm->total_out;
 
 	return 0;
 }
 
-static int lzo_compress(void *in_buf, size_t in_len, void *out_buf,
-			size_t *out_len)
+static int lzo_compress(struct compr_ctx *ctx, void *in_buf, size_t in_len,
+			void *out_buf, size_t *out_len)
 {
 	lzo_uint len;
 	int ret;
 
 	len = *out_len;
-	ret = lzo1x_999_compress(in_buf, in_len, out_buf, &len, lzo_mem);
+	ret = ctx->lzo_compr(in_buf, in_len, out_buf, &len, ctx->lzo_mem);
 	*out_len = len;
 
 	if (ret != LZO_E_OK) {
-		errcnt += 1;
+		ctx->errcnt += 1;
 		return -1;
 	}
 
@@ -112,17 +125,56 @@ static int no_compress(void *in_buf, size_t in_len, void *out_buf,
 	return 0;
 }
 
-static char *zlib_buf;
+/**
+ * looks_incompressible - guess whether data are incompressible.
+ * @buf: data
+ * @len: length of data
+ *
+ * This is a cheap estimate based on the byte value histogram of the data,
+ * which is good at recognizing already compressed or encrypted data. Returns
+ * %1 if @buf most probably cannot be compressed and %0 otherwise.
+ */
+static int looks_incompressible(const unsigned char *buf, size_t len)
+{
+	unsigned int cnt[256];
+	double entropy = 0;
+	size_t i;
+
+	memset(cnt, 0, sizeof(cnt));
+	for (i = 0; i < len; i++)
+		cnt[buf[i]] += 1;
+	for (i = 0; i < 256; i++)
+		if (cnt[i])
+			entropy -= cnt[i] * log2((double)cnt[i] / len);
+
+	return entropy / len > PRECHECK_ENTROPY;
+}
 
-static int favor_lzo_compress(void *in_buf, size_t in_len, void *out_buf,
-			       size_t *out_len, int *type)
+static int favor_lzo_compress(struct compr_ctx *ctx, void *in_buf,
+			      size_t in_len, void *out_buf, size_t *out_len,
+			      int *type)
 {
 	int lzo_ret, zlib_ret;
 	size_t lzo_len, zlib_len;
 
 	lzo_len = zlib_len = *out_len;
-	lzo_ret = lzo_compress(in_buf, in_len, out_buf, &lzo_len);
-	zlib_ret = zlib_deflate(in_buf, in_len, zlib_buf, &zlib_len);
+	if (c->favor_precheck && looks_incompressible(in_buf, in_len)) {
+		/*
+		 * Try the cheaper zlib first and do not bother with the slow
+		 * LZO999 if zlib cannot compress the data either.
+		 */
+		zlib_ret = zlib_deflate(ctx, in_buf, in_len, ctx->zlib_buf,
+					&zlib_len);
+		if (zlib_ret || zlib_len >= in_len) {
+			ctx->lzo_skipped += 1;
+			return -1;
+		}
+		lzo_ret = lzo_compress(ctx, in_buf, in_len, out_buf, &lzo_len);
+	} else {
+		lzo_ret = lzo_compress(ctx, in_buf, in_len, out_buf, &lzo_len);
+		zlib_ret = zlib_deflate(ctx, in_buf, in_len, ctx->zlib_buf,
+					&zlib_len);
+	}
 
 	if (lzo_ret && zlib_ret)
 		/* Both compressors failed */
@@ -156,12 +208,12 @@ select_lzo:
 select_zlib:
 	*out_len = zlib_len;
 	*type = MKFS_UBIFS_COMPR_ZLIB;
-	memcpy(out_buf, zlib_buf, zlib_len);
+	memcpy(out_buf, ctx->zlib_buf, zlib_len);
 	return 0;
 }
 
-int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
-		  int type)
+int compress_data(struct compr_ctx *ctx, void *in_buf, size_t in_len,
+		  void *out_buf, size_t *out_len, int type)
 {
 	int ret;
 
@@ -171,20 +223,23 @@ int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
 	}
 
 	if (c->favor_lzo)
-		ret = favor_lzo_compress(in_buf, in_len, out_buf, out_len, &type);
+		ret = favor_lzo_compress(ctx, in_buf, in_len, out_buf, out_len,
+					 &type);
 	else {
 		switch (type) {
 		case MKFS_UBIFS_COMPR_LZO:
-			ret = lzo_compress(in_buf, in_len, out_buf, out_len);
+			ret = lzo_compress(ctx, in_buf, in_len, out_buf,
+					   out_len);
 			break;
 		case MKFS_UBIFS_COMPR_ZLIB:
-			ret = zlib_deflate(in_buf, in_len, out_buf, out_len);
+			ret = zlib_deflate(ctx, in_buf, in_len, out_buf,
+					   out_len);
 			break;
 		case MKFS_UBIFS_COMPR_NONE:
 			ret = 1;
 			break;
 		default:
-			errcnt += 1;
+			ctx->errcnt += 1;
 			ret = 1;
 			break;
 		}
@@ -196,25 +251,146 @@ int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
 	return type;
 }
 
-int init_compression(void)
+/**
+ * decompress_data - decompress a data node.
+ * @in_buf: compressed data
+ * @in_len: length of the compressed data
+ * @out_buf: uncompressed data are returned here
+ * @out_len: size of @out_buf on input, length of the uncompressed data on
+ *           output
+ * @type: compressor the data were compressed with
+ *
+ * Returns %0 on success and %-1 if the data cannot be decompressed.
+ */
+int decompress_data(void *in_buf, size_t in_len, void *out_buf,
+		    size_t *out_len, int type)
 {
-	lzo_mem = malloc(LZO1X_999_MEM_COMPRESS);
-	if (!lzo_mem)
-		return -1;
+	lzo_uint len;
+	z_stream strm;
+	int ret;
 
-	zlib_buf = malloc(UBIFS_BLOCK_SIZE * WORST_COMPR_FACTOR);
-	if (!zlib_buf) {
-		free(lzo_mem);
+	switch (type) {
+	case MKFS_UBIFS_COMPR_NONE:
+		if (in_len > *out_len)
+			return -1;
+		memcpy(out_buf, in_buf, in_len);
+		*out_len = in_len;
+		return 0;
+	case MKFS_UBIFS_COMPR_LZO:
+		len = *out_len;
+		ret = lzo1x_decompress_safe(in_buf, in_len, out_buf, &len,
+					    NULL);
+		*out_len = len;
+		return ret == LZO_E_OK ? 0 : -1;
+	case MKFS_UBIFS_COMPR_ZLIB:
+		memset(&strm, 0, sizeof(strm));
+		if (inflateInit2(&strm, -DEFLATE_DEF_WINBITS) != Z_OK)
+			return -1;
+		strm.next_in = in_buf;
+		strm.avail_in = in_len;
+		strm.next_out = out_buf;
+		strm.avail_out = *out_len;
+		ret = inflate(&strm, Z_FINISH);
+		*out_len = strm.total_out;
+		inflateEnd(&strm);
+		return ret == Z_STREAM_END ? 0 : -1;
+	default:
 		return -1;
 	}
+}
 
-	return 0;
+/**
+ * lzo_compr_name - get name of the LZO compressor used at a compression level.
+ * @level: compression level
+ */
+const char *lzo_compr_name(int level)
+{
+	if (level <= 2)
+		return "lzo1x_1";
+	if (level <= 5)
+		return "lzo1x_1_15";
+	return "lzo1x_999";
+}
+
+/**
+ * init_compr_ctx - allocate and initialize a compressor context.
+ *
+ * The compressors are set up for the compression level of the file-system
+ * description object. Returns the new context in case of success and %NULL in
+ * case of failure.
+ */
+struct compr_ctx *init_compr_ctx(void)
+{
+	struct compr_ctx *ctx;
+	size_t lzo_mem_sz;
+
+	ctx = calloc(1, sizeof(struct compr_ctx));
+	if (!ctx)
+		return NULL;
+
+	if (c->compr_level <= 2) {
+		ctx->lzo_compr = lzo1x_1_compress;
+		lzo_mem_sz = LZO1X_1_MEM_COMPRESS;
+	} else if (c->compr_level <= 5) {
+		ctx->lzo_compr = lzo1x_1_15_compress;
+		lzo_mem_sz = LZO1X_1_15_MEM_COMPRESS;
+	} else {
+		ctx->lzo_compr = lzo1x_999_compress;
+		lzo_mem_sz = LZO1X_999_MEM_COMPRESS;
+	}
+
+	ctx->lzo_mem = malloc(lzo_mem_sz);
+	if (!ctx->lzo_mem)
+		goto out_free;
+
+	ctx->zlib_buf = malloc(UBIFS_BLOCK_SIZE * WORST_COMPR_FACTOR);
+	if (!ctx->zlib_buf)
+		goto out_free;
+
+	/*
+	 * Match exactly the zlib parameters used by the Linux kernel crypto
+	 * API.
+	 */
+	ctx->strm.zalloc = NULL;
+	ctx->strm.zfree = NULL;
+	ctx->strm.opaque = NULL;
+	if (deflateInit2(&ctx->strm, c->compr_level, Z_DEFLATED,
+			 -DEFLATE_DEF_WINBITS, DEFLATE_DEF_MEMLEVEL,
+			 Z_DEFAULT_STRATEGY))
+		goto out_free;
+
+	return ctx;
+
+out_free:
+	free(ctx->zlib_buf);
+	free(ctx->lzo_mem);
+	free(ctx);
+	return NULL;
+}
+
+/**
+ * destroy_compr_ctx - free a compressor context.
+ * @ctx: the context to free
+ *
+ * The compression errors which happened in @ctx are accounted to the total
+ * count reported by 'destroy_compression()'.
+ */
+void destroy_compr_ctx(struct compr_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	deflateEnd(&ctx->strm);
+	__sync_fetch_and_add(&errcnt, ctx->errcnt);
+	__sync_fetch_and_add(&lzo_skipped, ctx->lzo_skipped);
+	free(ctx->zlib_buf);
+	free(ctx->lzo_mem);
+	free(ctx);
 }
 
 void destroy_compression(void)
 {
-	free(zlib_buf);
-	free(lzo_mem);
+	if (verbose && c->favor_precheck)
+		printf("\tLZO skipped:  %llu blocks\n", lzo_skipped);
 	if (errcnt)
 		fprintf(stderr, "%llu compression errors occurred\n", errcnt);
 }
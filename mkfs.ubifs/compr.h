@@ -31,6 +31,15 @@
  */
 #define WORST_COMPR_FACTOR 4
 
+/*
+ * Compression levels. The level is the zlib level, and it also selects the LZO
+ * compressor: lzo1x_1 for levels 1-2, lzo1x_1_15 for levels 3-5, and lzo1x_999
+ * for levels 6-9.
+ */
+#define MIN_COMPR_LEVEL 1
+#define MAX_COMPR_LEVEL 9
+#define DEFAULT_COMPR_LEVEL 6
+
 enum compression_type
 {
 	MKFS_UBIFS_COMPR_NONE,
@@ -38,9 +47,15 @@ enum compression_type
 	MKFS_UBIFS_COMPR_ZLIB,
 };
 
-int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
-		  int type);
-int init_compression(void);
+struct compr_ctx;
+
+int compress_data(struct compr_ctx *ctx, void *in_buf, size_t in_len,
+		  void *out_buf, size_t *out_len, int type);
+int decompress_data(void *in_buf, size_t in_len, void *out_buf,
+		    size_t *out_len, int type);
+const char *lzo_compr_name(int level);
+struct compr_ctx *init_compr_ctx(void);
+void destroy_compr_ctx(struct compr_ctx *ctx);
 void destroy_compression(void);
 
 #endif
@@ -40,16 +40,49 @@ uint16_t const crc16_table[256] = {
 	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
 };
 
+/*
+ * Tables for the slice-by-8 algorithm: crc16_tables[n][b] is the CRC of byte
+ * @b followed by @n zero bytes. They are derived from crc16_table at start-up.
+ */
+static uint16_t crc16_tables[8][256];
+
+static void __attribute__((constructor)) crc16_init(void)
+{
+	uint16_t v;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		v = crc16_table[i];
+		for (j = 0; j < 8; j++) {
+			crc16_tables[j][i] = v;
+			v = crc16_byte(v, 0);
+		}
+	}
+}
+
 /**
  * crc16 - compute the CRC-16 for the data buffer
  * @crc:	previous CRC value
  * @buffer:	data pointer
  * @len:	number of bytes in the buffer
  *
- * Returns the updated CRC value.
+ * Returns the updated CRC value, so a large buffer may be processed in pieces
+ * by passing the result for one piece as @crc for the next one.
  */
 uint16_t crc16(uint16_t crc, uint8_t const *buffer, size_t len)
 {
+	const uint16_t (*t)[256] = crc16_tables;
+
+	/* Slice-by-8: process 8 bytes per step using 8 tables */
+	while (len >= 8) {
+		crc = t[7][(crc ^ buffer[0]) & 0xff] ^
+		      t[6][(crc >> 8) ^ buffer[1]] ^
+		      t[5][buffer[2]] ^ t[4][buffer[3]] ^
+		      t[3][buffer[4]] ^ t[2][buffer[5]] ^
+		      t[1][buffer[6]] ^ t[0][buffer[7]];
+		buffer += 8;
+		len -= 8;
+	}
 	while (len--)
 		crc = crc16_byte(crc, *buffer++);
 	return crc;
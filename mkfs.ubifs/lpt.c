@@ -164,47 +164,80 @@ int calc_dflt_lpt_geom(struct ubifs_info *c, int *main_lebs, int *big_lpt)
 }
 
 /**
- * pack_bits - pack bit fields end-to-end.
- * @addr: address at which to pack (passed and next address returned)
- * @pos: bit position at which to pack (passed and next position returned)
+ * struct bit_writer - packs bit fields end-to-end.
+ * @p: address at which the next byte is stored
+ * @acc: bits which are not stored yet
+ * @cnt: count of bits in @acc
+ *
+ * Bit fields are accumulated in a 64-bit word and stored 32 bits at a time,
+ * least significant bits first, which is the LPT on-flash bit order.
+ */
+struct bit_writer {
+	uint8_t *p;
+	uint64_t acc;
+	int cnt;
+};
+
+/**
+ * bw_init - initialize a bit writer.
+ * @bw: bit writer
+ * @buf: buffer into which to pack
+ */
+static inline void bw_init(struct bit_writer *bw, void *buf)
+{
+	bw->p = buf;
+	bw->acc = 0;
+	bw->cnt = 0;
+}
+
+/**
+ * bw_put - pack a bit field.
+ * @bw: bit writer
  * @val: value to pack
  * @nrbits: number of bits of value to pack (1-32)
  */
-static void pack_bits(uint8_t **addr, int *pos, uint32_t val, int nrbits)
+static inline void bw_put(struct bit_writer *bw, uint32_t val, int nrbits)
 {
-	uint8_t *p = *addr;
-	int b = *pos;
-
-	if (b) {
-		*p |= ((uint8_t)val) << b;
-		nrbits += b;
-		if (nrbits > 8) {
-			*++p = (uint8_t)(val >>= (8 - b));
-			if (nrbits > 16) {
-				*++p = (uint8_t)(val >>= 8);
-				if (nrbits > 24) {
-					*++p = (uint8_t)(val >>= 8);
-					if (nrbits > 32)
-						*++p = (uint8_t)(val >>= 8);
-				}
-			}
-		}
-	} else {
-		*p = (uint8_t)val;
-		if (nrbits > 8) {
-			*++p = (uint8_t)(val >>= 8);
-			if (nrbits > 16) {
-				*++p = (uint8_t)(val >>= 8);
-				if (nrbits > 24)
-					*++p = (uint8_t)(val >>= 8);
-			}
-		}
+	bw->acc |= (uint64_t)(val & (0xffffffffU >> (32 - nrbits))) << bw->cnt;
+	bw->cnt += nrbits;
+	if (bw->cnt >= 32) {
+		bw->p[0] = bw->acc;
+		bw->p[1] = bw->acc >> 8;
+		bw->p[2] = bw->acc >> 16;
+		bw->p[3] = bw->acc >> 24;
+		bw->p += 4;
+		bw->acc >>= 32;
+		bw->cnt -= 32;
+	}
+}
+
+/**
+ * bw_flush - store the remaining bits, the last byte is padded with zeroes.
+ * @bw: bit writer
+ */
+static inline void bw_flush(struct bit_writer *bw)
+{
+	while (bw->cnt > 0) {
+		*bw->p++ = bw->acc;
+		bw->acc >>= 8;
+		bw->cnt -= 8;
 	}
-	b = nrbits & 7;
-	if (b == 0)
-		p++;
-	*addr = p;
-	*pos = b;
+	bw->cnt = 0;
+}
+
+/**
+ * pack_crc - calculate and store the CRC of a packed LPT node.
+ * @buf: the packed node
+ * @len: node length
+ */
+static void pack_crc(void *buf, int len)
+{
+	uint8_t *p = buf;
+	uint16_t crc;
+
+	crc = crc16(-1, buf + UBIFS_LPT_CRC_BYTES, len - UBIFS_LPT_CRC_BYTES);
+	p[0] = crc;
+	p[1] = crc >> 8;
 }
 
 /**
@@ -216,28 +249,20 @@ static void pack_bits(uint8_t **addr, int *pos, uint32_t val, int nrbits)
 static void pack_pnode(struct ubifs_info *c, void *buf,
 		       struct ubifs_pnode *pnode)
 {
-	uint8_t *addr = buf + UBIFS_LPT_CRC_BYTES;
-	int i, pos = 0;
-	uint16_t crc;
+	struct bit_writer bw;
+	int i;
 
-	pack_bits(&addr, &pos, UBIFS_LPT_PNODE, UBIFS_LPT_TYPE_BITS);
+	bw_init(&bw, buf + UBIFS_LPT_CRC_BYTES);
+	bw_put(&bw, UBIFS_LPT_PNODE, UBIFS_LPT_TYPE_BITS);
 	if (c->big_lpt)
-		pack_bits(&addr, &pos, pnode->num, c->pcnt_bits);
+		bw_put(&bw, pnode->num, c->pcnt_bits);
 	for (i = 0; i < UBIFS_LPT_FANOUT; i++) {
-		pack_bits(&addr, &pos, pnode->lprops[i].free >> 3,
-			  c->space_bits);
-		pack_bits(&addr, &pos, pnode->lprops[i].dirty >> 3,
-			  c->space_bits);
-		if (pnode->lprops[i].flags & LPROPS_INDEX)
-			pack_bits(&addr, &pos, 1, 1);
-		else
-			pack_bits(&addr, &pos, 0, 1);
+		bw_put(&bw, pnode->lprops[i].free >> 3, c->space_bits);
+		bw_put(&bw, pnode->lprops[i].dirty >> 3, c->space_bits);
+		bw_put(&bw, !!(pnode->lprops[i].flags & LPROPS_INDEX), 1);
 	}
-	crc = crc16(-1, buf + UBIFS_LPT_CRC_BYTES,
-		    c->pnode_sz - UBIFS_LPT_CRC_BYTES);
-	addr = buf;
-	pos = 0;
-	pack_bits(&addr, &pos, crc, UBIFS_LPT_CRC_BITS);
+	bw_flush(&bw);
+	pack_crc(buf, c->pnode_sz);
 }
 
 /**
@@ -249,27 +274,23 @@ static void pack_pnode(struct ubifs_info *c, void *buf,
 static void pack_nnode(struct ubifs_info *c, void *buf,
 		       struct ubifs_nnode *nnode)
 {
-	uint8_t *addr = buf + UBIFS_LPT_CRC_BYTES;
-	int i, pos = 0;
-	uint16_t crc;
+	struct bit_writer bw;
+	int i;
 
-	pack_bits(&addr, &pos, UBIFS_LPT_NNODE, UBIFS_LPT_TYPE_BITS);
+	bw_init(&bw, buf + UBIFS_LPT_CRC_BYTES);
+	bw_put(&bw, UBIFS_LPT_NNODE, UBIFS_LPT_TYPE_BITS);
 	if (c->big_lpt)
-		pack_bits(&addr, &pos, nnode->num, c->pcnt_bits);
+		bw_put(&bw, nnode->num, c->pcnt_bits);
 	for (i = 0; i < UBIFS_LPT_FANOUT; i++) {
 		int lnum = nnode->nbranch[i].lnum;
 
 		if (lnum == 0)
 			lnum = c->lpt_last + 1;
-		pack_bits(&addr, &pos, lnum - c->lpt_first, c->lpt_lnum_bits);
-		pack_bits(&addr, &pos, nnode->nbranch[i].offs,
-			  c->lpt_offs_bits);
+		bw_put(&bw, lnum - c->lpt_first, c->lpt_lnum_bits);
+		bw_put(&bw, nnode->nbranch[i].offs, c->lpt_offs_bits);
 	}
-	crc = crc16(-1, buf + UBIFS_LPT_CRC_BYTES,
-		    c->nnode_sz - UBIFS_LPT_CRC_BYTES);
-	addr = buf;
-	pos = 0;
-	pack_bits(&addr, &pos, crc, UBIFS_LPT_CRC_BITS);
+	bw_flush(&bw);
+	pack_crc(buf, c->nnode_sz);
 }
 
 /**
@@ -281,20 +302,17 @@ static void pack_nnode(struct ubifs_info *c, void *buf,
 static void pack_ltab(struct ubifs_info *c, void *buf,
 			 struct ubifs_lpt_lprops *ltab)
 {
-	uint8_t *addr = buf + UBIFS_LPT_CRC_BYTES;
-	int i, pos = 0;
-	uint16_t crc;
+	struct bit_writer bw;
+	int i;
 
-	pack_bits(&addr, &pos, UBIFS_LPT_LTAB, UBIFS_LPT_TYPE_BITS);
+	bw_init(&bw, buf + UBIFS_LPT_CRC_BYTES);
+	bw_put(&bw, UBIFS_LPT_LTAB, UBIFS_LPT_TYPE_BITS);
 	for (i = 0; i < c->lpt_lebs; i++) {
-		pack_bits(&addr, &pos, ltab[i].free, c->lpt_spc_bits);
-		pack_bits(&addr, &pos, ltab[i].dirty, c->lpt_spc_bits);
+		bw_put(&bw, ltab[i].free, c->lpt_spc_bits);
+		bw_put(&bw, ltab[i].dirty, c->lpt_spc_bits);
 	}
-	crc = crc16(-1, buf + UBIFS_LPT_CRC_BYTES,
-		    c->ltab_sz - UBIFS_LPT_CRC_BYTES);
-	addr = buf;
-	pos = 0;
-	pack_bits(&addr, &pos, crc, UBIFS_LPT_CRC_BITS);
+	bw_flush(&bw);
+	pack_crc(buf, c->ltab_sz);
 }
 
 /**
@@ -305,18 +323,15 @@ static void pack_ltab(struct ubifs_info *c, void *buf,
  */
 static void pack_lsave(struct ubifs_info *c, void *buf, int *lsave)
 {
-	uint8_t *addr = buf + UBIFS_LPT_CRC_BYTES;
-	int i, pos = 0;
-	uint16_t crc;
+	struct bit_writer bw;
+	int i;
 
-	pack_bits(&addr, &pos, UBIFS_LPT_LSAVE, UBIFS_LPT_TYPE_BITS);
+	bw_init(&bw, buf + UBIFS_LPT_CRC_BYTES);
+	bw_put(&bw, UBIFS_LPT_LSAVE, UBIFS_LPT_TYPE_BITS);
 	for (i = 0; i < c->lsave_cnt; i++)
-		pack_bits(&addr, &pos, lsave[i], c->lnum_bits);
-	crc = crc16(-1, buf + UBIFS_LPT_CRC_BYTES,
-		    c->lsave_sz - UBIFS_LPT_CRC_BYTES);
-	addr = buf;
-	pos = 0;
-	pack_bits(&addr, &pos, crc, UBIFS_LPT_CRC_BITS);
+		bw_put(&bw, lsave[i], c->lnum_bits);
+	bw_flush(&bw);
+	pack_crc(buf, c->lsave_sz);
 }
 
 /**
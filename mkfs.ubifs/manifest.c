@@ -0,0 +1,465 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This file implements image manifests, which make incremental image builds
+ * possible. A manifest is a text file which lists the data nodes of every
+ * regular file of an image:
+ *
+ * ubifs-manifest 2 <leb_size> <compr_level> <favor_lzo> <favor_percent>
+ *                <favor_precheck>
+ * f <size> <mtime> <path>
+ * b <block_no> <len> <crc> <compr> <lnum> <offs> <node_len>
+ * ...
+ *
+ * The header line records the settings the compressed data depend on. An 'f'
+ * line starts a file: its size, modification time and path relative to the
+ * root directory. It is followed by a 'b' line for each data node of the file:
+ * the block number, uncompressed length, CRC32 of the uncompressed data,
+ * requested compressor and the position and length of the node in the image.
+ *
+ * When an image is built with a base image and its manifest, the compressed
+ * data of blocks of unchanged files are taken from the data nodes of the base
+ * image rather than compressed again. A file is unchanged if its size and
+ * modification time are the same. The CRC32 of a block quickly rules out
+ * changed data, and a block which passes it is decompressed from the base image
+ * and compared to the new data, so a wrong block is never reused. The rest of
+ * the image (inodes, directory entries, index and LPT) is built as usual, so
+ * the image is the same as if it was built from scratch.
+ */
+
+#include "mkfs.ubifs.h"
+#include "hashtable/hashtable.h"
+#include "hashtable/hashtable_itr.h"
+#include <libubigen.h>
+#include <crc32.h>
+
+#define MANIFEST_MAGIC "ubifs-manifest"
+#define MANIFEST_VERSION 2
+
+/**
+ * struct base_block - a data node of a file in the base image.
+ * @block_no: block number within the file
+ * @len: length of the uncompressed data
+ * @hash: CRC32 of the uncompressed data
+ * @use_compr: compressor which was requested
+ * @lnum: LEB number of the node
+ * @offs: offset of the node
+ * @node_len: length of the node
+ */
+struct base_block {
+	unsigned int block_no;
+	int len;
+	uint32_t hash;
+	int use_compr;
+	int lnum;
+	int offs;
+	int node_len;
+};
+
+/**
+ * struct base_file - a file of the base image.
+ * @size: file size
+ * @mtime: file modification time
+ * @cnt: count of data nodes
+ * @max: count of data nodes @blocks has space for
+ * @blocks: data nodes in block number order
+ */
+struct base_file {
+	long long size;
+	long long mtime;
+	int cnt;
+	int max;
+	struct base_block *blocks;
+};
+
+static struct ubifs_info *c = &info_;
+
+/* The manifest being written */
+static FILE *manifest;
+static int manifest_skip;
+
+/* The base image and its files */
+static int base_fd = -1;
+static int base_leb_size;
+static struct hashtable *base_htbl;
+static void *base_node;
+static void *base_data;
+static unsigned long long base_reused;
+
+/* Hash function used for the file hash table */
+static unsigned int r5_hash(void *s)
+{
+	unsigned int a = 0;
+	const signed char *str = s;
+
+	while (*str) {
+		a += *str << 4;
+		a += *str >> 4;
+		a *= 11;
+		str++;
+	}
+
+	return a;
+}
+
+/* Comparison function used for the file hash table */
+static int is_equivalent(void *k1, void *k2)
+{
+	return !strcmp(k1, k2);
+}
+
+/**
+ * manifest_open - start writing a manifest.
+ * @file: manifest file name
+ */
+int manifest_open(const char *file)
+{
+	manifest = fopen(file, "w");
+	if (!manifest)
+		return sys_err_msg("cannot create manifest '%s'", file);
+	fprintf(manifest, "%s %d %d %d %d %d %d\n", MANIFEST_MAGIC,
+		MANIFEST_VERSION, c->leb_size, c->compr_level, c->favor_lzo,
+		c->favor_percent, c->favor_precheck);
+	return 0;
+}
+
+/**
+ * manifest_add_file - add a file to the manifest.
+ * @path: file path relative to the root directory
+ * @st: file stat information
+ *
+ * Paths containing a newline cannot be recorded, such files are left out of
+ * the manifest.
+ */
+int manifest_add_file(const char *path, const struct stat *st)
+{
+	if (!manifest)
+		return 0;
+	manifest_skip = !!strchr(path, '\n');
+	if (manifest_skip)
+		return 0;
+	if (fprintf(manifest, "f %lld %lld %s\n", (long long)st->st_size,
+		    (long long)st->st_mtime, path) < 0)
+		return sys_err_msg("cannot write manifest");
+	return 0;
+}
+
+/**
+ * manifest_add_block - add a data node of the last added file to the manifest.
+ * @block_no: block number within the file
+ * @len: length of the uncompressed data
+ * @hash: CRC32 of the uncompressed data
+ * @use_compr: compressor which was requested
+ * @lnum: LEB number of the node
+ * @offs: offset of the node
+ * @node_len: length of the node
+ */
+int manifest_add_block(unsigned int block_no, int len, uint32_t hash,
+		       int use_compr, int lnum, int offs, int node_len)
+{
+	if (!manifest || manifest_skip)
+		return 0;
+	if (fprintf(manifest, "b %u %d %08x %d %d %d %d\n", block_no, len,
+		    hash, use_compr, lnum, offs, node_len) < 0)
+		return sys_err_msg("cannot write manifest");
+	return 0;
+}
+
+/**
+ * manifest_close - finish writing the manifest.
+ */
+int manifest_close(void)
+{
+	int err;
+
+	if (!manifest)
+		return 0;
+	err = fclose(manifest);
+	manifest = NULL;
+	if (err)
+		return sys_err_msg("cannot write manifest");
+	return 0;
+}
+
+/**
+ * free_base_file - free a base image file description.
+ * @bf: file description
+ */
+static void free_base_file(struct base_file *bf)
+{
+	free(bf->blocks);
+	free(bf);
+}
+
+/**
+ * add_base_block - add a data node to a base image file description.
+ * @bf: file description
+ * @bb: data node description
+ */
+static int add_base_block(struct base_file *bf, struct base_block *bb)
+{
+	struct base_block *blocks;
+
+	if (bf->cnt && bb->block_no <= bf->blocks[bf->cnt - 1].block_no)
+		return -1;
+	if (bf->cnt == bf->max) {
+		bf->max = bf->max ? bf->max * 2 : 16;
+		blocks = realloc(bf->blocks,
+				 bf->max * sizeof(struct base_block));
+		if (!blocks)
+			return -1;
+		bf->blocks = blocks;
+	}
+	bf->blocks[bf->cnt++] = *bb;
+	return 0;
+}
+
+/**
+ * read_base_manifest - read the manifest of the base image.
+ * @file: manifest file name
+ *
+ * Returns %0 on success, %1 if the manifest was made with different
+ * compression settings and %-1 on error.
+ */
+static int read_base_manifest(const char *file)
+{
+	FILE *f;
+	char *line = NULL, *path;
+	size_t len = 0;
+	int n, ver, level, favor_lzo, percent, precheck, lnr = 1, err = -1;
+	long long size, mtime;
+	struct base_file *bf = NULL;
+	struct base_block bb;
+
+	f = fopen(file, "r");
+	if (!f)
+		return sys_err_msg("cannot open base manifest '%s'", file);
+
+	if (getline(&line, &len, f) == -1 ||
+	    sscanf(line, MANIFEST_MAGIC " %d %d %d %d %d %d", &ver,
+		   &base_leb_size, &level, &favor_lzo, &percent,
+		   &precheck) != 6 ||
+	    ver != MANIFEST_VERSION || base_leb_size <= 0) {
+		err_msg("'%s' is not a manifest", file);
+		goto out;
+	}
+	if (level != c->compr_level || favor_lzo != c->favor_lzo ||
+	    percent != c->favor_percent || precheck != c->favor_precheck) {
+		err = 1;
+		goto out;
+	}
+
+	base_htbl = create_hashtable(1024, &r5_hash, &is_equivalent);
+	if (!base_htbl) {
+		err_msg("cannot create base file hash table");
+		goto out;
+	}
+
+	while (getline(&line, &len, f) != -1) {
+		lnr += 1;
+		if (line[0] == 'b' && bf) {
+			if (sscanf(line, "b %u %d %x %d %d %d %d", &bb.block_no,
+				   &bb.len, &bb.hash, &bb.use_compr, &bb.lnum,
+				   &bb.offs, &bb.node_len) != 7 ||
+			    bb.node_len < UBIFS_DATA_NODE_SZ ||
+			    bb.node_len > UBIFS_MAX_DATA_NODE_SZ)
+				goto bad_line;
+			if (add_base_block(bf, &bb))
+				goto bad_line;
+			continue;
+		}
+		if (line[0] != 'f' ||
+		    sscanf(line, "f %lld %lld %n", &size, &mtime, &n) != 2)
+			goto bad_line;
+		path = line + n;
+		path[strcspn(path, "\n")] = '\0';
+
+		bf = calloc(1, sizeof(struct base_file));
+		path = strdup(path);
+		if (!bf || !path) {
+			free(bf);
+			free(path);
+			err_msg("out of memory");
+			goto out;
+		}
+		bf->size = size;
+		bf->mtime = mtime;
+		if (hashtable_search(base_htbl, path) ||
+		    !hashtable_insert(base_htbl, path, bf)) {
+			free_base_file(bf);
+			free(path);
+			goto bad_line;
+		}
+	}
+	if (ferror(f)) {
+		sys_err_msg("cannot read base manifest '%s'", file);
+		goto out;
+	}
+	err = 0;
+	goto out;
+
+bad_line:
+	err_msg("bad line %d in base manifest '%s'", lnr, file);
+out:
+	free(line);
+	fclose(f);
+	return err;
+}
+
+/**
+ * base_open - open a base image and read its manifest.
+ * @image: base image file name
+ * @file: base manifest file name
+ */
+int base_open(const char *image, const char *file)
+{
+	__le32 magic;
+	int err;
+
+	err = read_base_manifest(file);
+	if (err == 1) {
+		if (verbose)
+			printf("\tbase manifest was made with other "
+			       "compression settings, not using it\n");
+		return 0;
+	}
+	if (err)
+		return err;
+
+	base_fd = open(image, O_RDONLY | O_LARGEFILE);
+	if (base_fd == -1)
+		return sys_err_msg("cannot open base image '%s'", image);
+	if (pread(base_fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+	    le32_to_cpu(magic) == UBIGEN_COMPACT_MAGIC)
+		return err_msg("compact base images are not supported");
+
+	base_node = malloc(UBIFS_MAX_DATA_NODE_SZ);
+	base_data = malloc(UBIFS_BLOCK_SIZE);
+	if (!base_node || !base_data)
+		return err_msg("out of memory");
+	return 0;
+}
+
+/**
+ * base_find_file - find an unchanged file in the base image.
+ * @path: file path relative to the root directory
+ * @st: file stat information
+ *
+ * Returns the file description if the base image has the file with the same
+ * size and modification time and %NULL otherwise.
+ */
+struct base_file *base_find_file(const char *path, const struct stat *st)
+{
+	struct base_file *bf;
+
+	if (base_fd == -1)
+		return NULL;
+	bf = hashtable_search(base_htbl, (void *)path);
+	if (!bf || bf->size != st->st_size || bf->mtime != st->st_mtime)
+		return NULL;
+	return bf;
+}
+
+/**
+ * base_get_block - get compressed data of a block from the base image.
+ * @bf: file description
+ * @block_no: block number within the file
+ * @data: uncompressed data
+ * @len: length of the uncompressed data
+ * @hash: CRC32 of the uncompressed data
+ * @use_compr: compressor to use
+ * @out_buf: compressed data are returned here
+ * @out_len: length of the compressed data is returned here
+ * @compr_type: compressor actually used is returned here
+ *
+ * Returns %1 if the base image has the block with the same data compressed
+ * with the same compressor, and %0 otherwise. The data node is decompressed
+ * and compared to @data, a data node which fails the checks is not reused,
+ * which is not an error.
+ */
+int base_get_block(struct base_file *bf, unsigned int block_no,
+		   const void *data, int len, uint32_t hash, int use_compr,
+		   void *out_buf, size_t *out_len, int *compr_type)
+{
+	struct ubifs_data_node *dn = base_node;
+	struct base_block *bb;
+	int lo = 0, hi = bf->cnt - 1, mid;
+	size_t data_len = UBIFS_BLOCK_SIZE;
+	uint32_t crc;
+
+	for (bb = NULL; lo <= hi && !bb; ) {
+		mid = (lo + hi) / 2;
+		if (bf->blocks[mid].block_no < block_no)
+			lo = mid + 1;
+		else if (bf->blocks[mid].block_no > block_no)
+			hi = mid - 1;
+		else
+			bb = &bf->blocks[mid];
+	}
+	if (!bb || bb->len != len || bb->hash != hash ||
+	    bb->use_compr != use_compr)
+		return 0;
+
+	if (pread(base_fd, dn, bb->node_len,
+		  (off_t)bb->lnum * base_leb_size + bb->offs) != bb->node_len)
+		return 0;
+	crc = mtd_crc32(UBIFS_CRC32_INIT, (void *)dn + 8, bb->node_len - 8);
+	if (le32_to_cpu(dn->ch.magic) != UBIFS_NODE_MAGIC ||
+	    le32_to_cpu(dn->ch.crc) != crc ||
+	    le32_to_cpu(dn->ch.len) != bb->node_len ||
+	    dn->ch.node_type != UBIFS_DATA_NODE ||
+	    le32_to_cpu(dn->size) != len)
+		return 0;
+
+	*out_len = bb->node_len - UBIFS_DATA_NODE_SZ;
+	*compr_type = le16_to_cpu(dn->compr_type);
+	if (decompress_data(&dn->data, *out_len, base_data, &data_len,
+			    *compr_type) ||
+	    data_len != len || memcmp(base_data, data, len))
+		return 0;
+	memcpy(out_buf, &dn->data, *out_len);
+	base_reused += 1;
+	return 1;
+}
+
+/**
+ * base_close - close the base image and free its file descriptions.
+ */
+void base_close(void)
+{
+	struct hashtable_itr *itr;
+
+	if (verbose && base_fd != -1)
+		printf("\treused:       %llu blocks\n", base_reused);
+	if (base_htbl) {
+		if (hashtable_count(base_htbl) > 0) {
+			itr = hashtable_iterator(base_htbl);
+			do {
+				free_base_file(hashtable_iterator_value(itr));
+			} while (hashtable_iterator_advance(itr));
+			free(itr);
+		}
+		hashtable_destroy(base_htbl, 0);
+		base_htbl = NULL;
+	}
+	if (base_fd != -1)
+		close(base_fd);
+	base_fd = -1;
+	free(base_node);
+	base_node = NULL;
+	free(base_data);
+	base_data = NULL;
+}
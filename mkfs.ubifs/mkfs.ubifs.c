@@ -24,11 +24,17 @@
 #define PROGRAM_NAME "mkfs.ubifs"
 
 #include "mkfs.ubifs.h"
+#include <pthread.h>
+#include <sys/uio.h>
+#include <libubigen.h>
 #include <crc32.h>
 #include "common.h"
 
-/* Size (prime number) of hash table for link counting */
-#define HASH_TABLE_SIZE 10099
+/* Initial size (power of 2) of the hash table for link counting */
+#define HASH_TABLE_SIZE 1024
+
+/* How many inode mappings are allocated at once */
+#define INUM_MAPPINGS_CHUNK 1024
 
 /* The node buffer must allow for worst case compression */
 #define NODE_BUFFER_SIZE (UBIFS_DATA_NODE_SZ + \
@@ -37,23 +43,34 @@
 /* Default time granularity in nanoseconds */
 #define DEFAULT_TIME_GRAN 1000000000
 
+/* How many data blocks a batch holds per compression thread */
+#define COMPR_BATCH_BLOCKS 16
+
+/* Maximum count of compression threads */
+#define MAX_COMPR_JOBS 256
+
+/* How many LEBs may wait in the output queue */
+#define OUT_QUEUE_LEBS 8
+
+/* Initial count of index entries to allocate space for */
+#define IDX_ENTRIES_INIT 4096
+
+/* Default size of the cache of compressed data blocks */
+#define DEDUP_CACHE_DEFAULT (16 * 1024 * 1024)
+
 /**
  * struct idx_entry - index entry.
- * @next: next index entry (NULL at end of list)
- * @prev: previous index entry (NULL at beginning of list)
  * @key: key
  * @name: directory entry name used for sorting colliding keys by name
  * @lnum: LEB number
  * @offs: offset
  * @len: length
  *
- * The index is recorded as a linked list which is sorted and used to create
- * the bottom level of the on-flash index tree. The remaining levels of the
- * index tree are each built from the level below.
+ * The index is recorded as an array of index entries which is sorted and used
+ * to create the bottom level of the on-flash index tree. The remaining levels
+ * of the index tree are each built from the level below.
  */
 struct idx_entry {
-	struct idx_entry *next;
-	struct idx_entry *prev;
 	union ubifs_key key;
 	char *name;
 	int lnum;
@@ -61,10 +78,22 @@ struct idx_entry {
 	int len;
 };
 
+/**
+ * struct idx_sort_key - index entry sort key.
+ * @key: the index entry key packed into one integer which compares the same
+ *       way as the key itself
+ * @n: the index entry number
+ *
+ * The index is sorted as an array of these small elements rather than the
+ * index entries themselves.
+ */
+struct idx_sort_key {
+	uint64_t key;
+	size_t n;
+};
+
 /**
  * struct inum_mapping - inode number mapping for link counting.
- * @next: next inum_mapping (NULL at end of list)
- * @prev: previous inum_mapping (NULL at beginning of list)
  * @dev: source device on which the source inode number resides
  * @inum: source inode number of the file
  * @use_inum: target inode number of the file
@@ -79,11 +108,11 @@ struct idx_entry {
  * possibility that the file is linked from outside the source directory
  * hierarchy.
  *
- * The inum_mappings are stored in a hash_table of linked lists.
+ * The inum_mappings are allocated in chunks, in the order the files are found,
+ * and looked up in an open addressing hash table which is doubled in size when
+ * it gets half full.
  */
 struct inum_mapping {
-	struct inum_mapping *next;
-	struct inum_mapping *prev;
 	dev_t dev;
 	ino_t inum;
 	ino_t use_inum;
@@ -92,6 +121,115 @@ struct inum_mapping {
 	struct stat st;
 };
 
+/**
+ * struct data_block - a file data block which is being compressed.
+ * @block_no: block number within the file
+ * @len: count of bytes in @buf
+ * @use_compr: compressor to use
+ * @compr_type: compressor actually used is returned here
+ * @out_len: length of the compressed data is returned here
+ * @hash: hash of the uncompressed data
+ * @cached: the compressed data were taken from the dedup cache
+ * @buf: uncompressed data (%UBIFS_BLOCK_SIZE bytes)
+ * @dn: data node buffer the compressed data are stored to (%NODE_BUFFER_SIZE
+ *      bytes)
+ *
+ * Data blocks of a file are read and compressed in batches. When several
+ * compression threads are used, the blocks of a batch are compressed in
+ * parallel, but the data nodes are always added in block order, so the
+ * resulting image does not depend on the count of threads.
+ */
+struct data_block {
+	unsigned int block_no;
+	int len;
+	int use_compr;
+	int compr_type;
+	size_t out_len;
+	uint32_t hash;
+	int cached;
+	void *buf;
+	struct ubifs_data_node *dn;
+};
+
+/**
+ * struct dedup_entry - a compressed data block in the dedup cache.
+ * @hash: hash of the uncompressed data
+ * @use_compr: compressor which was requested
+ * @compr_type: compressor actually used
+ * @len: length of the uncompressed data
+ * @out_len: length of the compressed data
+ * @data: uncompressed data
+ * @cdata: compressed data
+ *
+ * Images often contain many identical files, so compressed data blocks are
+ * remembered in a direct-mapped cache and blocks with the same contents are
+ * not compressed again. The uncompressed data is kept to make sure a hash
+ * collision can never produce wrong data. The slots are allocated once and
+ * reused; compressed data are never longer than the uncompressed data, so a
+ * slot holds any block. A slot with zero @len is empty.
+ */
+struct dedup_entry {
+	uint32_t hash;
+	int use_compr;
+	int compr_type;
+	int len;
+	size_t out_len;
+	unsigned char data[UBIFS_BLOCK_SIZE];
+	unsigned char cdata[UBIFS_BLOCK_SIZE];
+};
+
+/**
+ * struct out_leb - a LEB queued for writing to the output file.
+ * @lnum: LEB number
+ * @len: length of data in @buf, the rest of the LEB is written as 0xff bytes
+ * @buf: LEB data (at least @len bytes)
+ */
+struct out_leb {
+	int lnum;
+	int len;
+	void *buf;
+};
+
+/**
+ * struct scan_dent - a directory entry found by the directory scan.
+ * @name: entry name
+ * @st: entry stat information
+ * @err: error code of a failed 'lstat()', @st is not valid then
+ * @dir: the scanned directory if the entry is a directory
+ */
+struct scan_dent {
+	char *name;
+	struct stat st;
+	int err;
+	struct scan_dir *dir;
+};
+
+/**
+ * struct scan_dir - a directory of the directory scan.
+ * @path: directory path name
+ * @dents: directory entries in the order 'readdir()' returned them
+ * @cnt: count of directory entries
+ * @max: count of directory entries @dents has space for
+ * @flags: directory inode flags
+ * @err: error code if scanning of the directory failed
+ * @err_op: the operation which failed ("open", "read" or "close")
+ * @next: next directory in the scan queue
+ *
+ * The source directory tree is scanned before any nodes are created. The
+ * directories are scanned in parallel, but the resulting tree does not depend
+ * on the order in which they were scanned, so neither does the image.
+ */
+struct scan_dir {
+	char *path;
+	struct scan_dent *dents;
+	int cnt;
+	int max;
+	int flags;
+	int err;
+	const char *err_op;
+	struct scan_dir *next;
+};
+
 /*
  * Because we copy functions from the kernel, we use a subset of the UBIFS
  * file-system description object struct ubifs_info.
@@ -110,30 +248,94 @@ static struct stat root_st;
 static char *output;
 static int out_fd;
 static int out_ubi;
+static int compact;
 static int squash_owner;
+static char *manifest_file;
+static char *base_image;
+static char *base_manifest;
+static int reproducible;
+static long long clamp_time = -1;
+static uint64_t image_hash[2];
 
 /* The 'head' (position) which nodes are written */
 static int head_lnum;
 static int head_offs;
 static int head_flags;
 
-/* The index list */
-static struct idx_entry *idx_list_first;
-static struct idx_entry *idx_list_last;
+/* The index entries */
+static struct idx_entry *idx_entries;
 static size_t idx_cnt;
+static size_t idx_max;
 
 /* Global buffers */
 static void *leb_buf;
 static void *node_buf;
-static void *block_buf;
 
-/* Hash table for inode link counting */
+/*
+ * Output queue. When the output is a file, LEBs are written by the output
+ * thread, so that building of nodes and output I/O overlap.
+ */
+static struct out_leb out_queue[OUT_QUEUE_LEBS];
+static int out_first;
+static int out_cnt;
+static void *out_bufs;
+static void *ff_buf;
+static pthread_t out_thread;
+static int out_thread_running;
+static int out_exit;
+static int out_err;
+static struct ubigen_compact_leb *compact_tbl;
+static off_t compact_end;
+static pthread_mutex_t out_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t out_queued_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t out_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* Compressor context of the main thread */
+static struct compr_ctx *compr_ctx;
+
+/* Data block batch and the compression threads working on it */
+static int compr_jobs = 1;
+static struct data_block *batch;
+static int batch_size;
+static int batch_cnt;
+static int batch_next;
+static int batch_done;
+static void *batch_bufs;
+static void *batch_dns;
+static pthread_t *compr_threads;
+static int compr_threads_cnt;
+static int compr_threads_exit;
+static int compr_threads_err;
+static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* The cache of compressed data blocks */
+static long long dedup_cache_size = DEDUP_CACHE_DEFAULT;
+static struct dedup_entry *dedup_cache;
+static size_t dedup_slots;
+static unsigned long long dedup_lookups;
+static unsigned long long dedup_hits;
+
+/* Queue of directories waiting to be scanned */
+static struct scan_dir *scan_queue;
+static int scan_pending;
+static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+
+/* Hash table for inode link counting and the inode mappings */
 static struct inum_mapping **hash_table;
+static size_t hash_table_size;
+static struct inum_mapping **im_chunks;
+static size_t im_cnt;
+static unsigned long long im_lookups;
+static unsigned long long im_probes;
+static unsigned int im_max_probes;
 
 /* Inode creation sequence number */
 static unsigned long long creat_sqnum;
 
-static const char *optstring = "d:r:m:o:D:h?vVe:c:g:f:Fp:k:x:X:j:R:l:j:UQq";
+static const char *optstring = "d:r:m:o:D:h?vVe:c:g:f:FPp:k:x:X:L:j:J:R:l:j:CM:B:b:ZK:UQq";
 
 static const struct option longopts[] = {
 	{"root",               1, NULL, 'r'},
@@ -150,12 +352,21 @@ static const struct option longopts[] = {
 	{"reserved",           1, NULL, 'R'},
 	{"compr",              1, NULL, 'x'},
 	{"favor-percent",      1, NULL, 'X'},
+	{"favor-precheck",     0, NULL, 'P'},
+	{"compr-level",        1, NULL, 'L'},
 	{"fanout",             1, NULL, 'f'},
 	{"space-fixup",        0, NULL, 'F'},
 	{"keyhash",            1, NULL, 'k'},
 	{"log-lebs",           1, NULL, 'l'},
 	{"orph-lebs",          1, NULL, 'p'},
 	{"squash-uids" ,       0, NULL, 'U'},
+	{"jobs",               1, NULL, 'J'},
+	{"compact",            0, NULL, 'C'},
+	{"manifest",           1, NULL, 'M'},
+	{"base",               1, NULL, 'B'},
+	{"base-manifest",      1, NULL, 'b'},
+	{"reproducible",       0, NULL, 'Z'},
+	{"dedup-cache",        1, NULL, 'K'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -182,6 +393,10 @@ static const char *helptext =
 "-X, --favor-percent      may only be used with favor LZO compression and defines\n"
 "                         how many percent better zlib should compress to make\n"
 "                         mkfs.ubifs use zlib instead of LZO (default 20%)\n"
+"-P, --favor-precheck     may only be used with favor LZO compression and makes\n"
+"                         mkfs.ubifs skip LZO for data which look incompressible\n"
+"-L, --compr-level=LEVEL  compression level from 1 (fastest) to 9 (best\n"
+"                         compression) (default: 6)\n"
 "-f, --fanout=NUM         fanout NUM (default: 8)\n"
 "-F, --space-fixup        file-system free space has to be fixed up on first mount\n"
 "                         (requires kernel version 3.0 or greater)\n"
@@ -189,6 +404,16 @@ static const char *helptext =
 "-p, --orph-lebs=COUNT    count of erase blocks for orphans (default: 1)\n"
 "-D, --devtable=FILE      use device table FILE\n"
 "-U, --squash-uids        squash owners making all files owned by root\n"
+"-J, --jobs=NUM           scan directories and compress data using NUM threads\n"
+"                         (default: 1)\n"
+"-C, --compact            write a compact image (see below)\n"
+"-M, --manifest=FILE      write the manifest of the image to FILE\n"
+"-B, --base=FILE          reuse compressed data of the base image FILE\n"
+"-b, --base-manifest=FILE manifest of the base image\n"
+"-Z, --reproducible       make the image depend only on the contents of the tree\n"
+"                         (see below)\n"
+"-K, --dedup-cache=SIZE   memory for the cache of compressed data blocks, 0\n"
+"                         disables it (default: 16MiB)\n"
 "-l, --log-lebs=COUNT     count of erase blocks for the log (used only for\n"
 "                         debugging)\n"
 "-v, --verbose            verbose operation\n"
@@ -206,6 +431,42 @@ static const char *helptext =
 "or more percent better than \"lzo\", mkfs.ubifs chooses \"lzo\", otherwise it chooses\n"
 "\"zlib\". The \"--favor-percent\" may specify arbitrary threshold instead of the\n"
 "default 20%.\n\n"
+"The \"--compr-level\" is the \"zlib\" compression level, and it also selects the\n"
+"\"lzo\" compressor flavor: \"lzo1x_1\" for levels 1-2, \"lzo1x_1_15\" for levels\n"
+"3-5, and the slow but best \"lzo1x_999\" for levels 6-9. Low levels are useful\n"
+"to quickly produce images for development.\n\n"
+"Favor LZO compression runs both compressors on every block. With the\n"
+"\"--favor-precheck\" option, blocks which look incompressible (e.g., already\n"
+"compressed media) are first compressed with \"zlib\" only, and if it fails to\n"
+"compress them, the slow \"lzo\" pass is skipped and the block is stored\n"
+"uncompressed. This makes favor LZO much faster on such data, but in rare cases\n"
+"a block which \"lzo\" alone could have compressed is left uncompressed.\n\n"
+"The -J parameter makes mkfs.ubifs compress file data in NUM parallel threads,\n"
+"which is much faster on multi-core machines when the \"zlib\" or \"favor_lzo\"\n"
+"compressors are used. The source directory tree is also scanned by NUM threads,\n"
+"which helps when it is on a slow file-system like NFS. The resulting image is\n"
+"the same regardless of NUM.\n\n"
+"Data blocks which were already compressed are remembered in a cache, and blocks\n"
+"with the same contents (e.g., from identical files) are not compressed again.\n"
+"The -K parameter sets how much memory the cache may use, and 0 disables it. The\n"
+"resulting image does not depend on the cache size. With -v, the \"dedup hits\"\n"
+"line shows how many blocks were taken from the cache.\n\n"
+"The -C parameter makes mkfs.ubifs write a compact image, which does not contain\n"
+"the 0xFF bytes at the end of LEBs, so it is much smaller and faster to write.\n"
+"Compact images are expanded on the fly by ubinize, the volume section of its\n"
+"configuration file has to say \"image_type=compact\".\n\n"
+"The -M parameter makes mkfs.ubifs write a manifest, which lists where the data\n"
+"of each file are in the image. When the image and its manifest are given to the\n"
+"next build with the -B and -b parameters, the data of files whose size and\n"
+"modification time did not change are taken from the image rather than\n"
+"compressed again, which makes rebuilds with few changed files much faster. The\n"
+"resulting image is the same as one built from scratch.\n\n"
+"The -Z parameter makes the image reproducible: directory entries and hard\n"
+"linked files are added in name order rather than in the order the host\n"
+"file-system returns them, access and change times are set to the modification\n"
+"time, and the UUID is derived from the image contents. If the SOURCE_DATE_EPOCH\n"
+"environment variable is set, later times are clamped to it. Building the same\n"
+"tree twice then gives the same image, so binary delta updates stay small.\n\n"
 "The -F parameter is used to set the \"fix up free space\" flag in the superblock,\n"
 "which forces UBIFS to \"fixup\" all the free space which it is going to use. This\n"
 "option is useful to work-around the problem of double free space programming: if the\n"
@@ -482,6 +743,7 @@ static int get_options(int argc, char**argv)
 	c->key_len = UBIFS_SK_LEN;
 	c->default_compr = UBIFS_COMPR_LZO;
 	c->favor_percent = 20;
+	c->compr_level = DEFAULT_COMPR_LEVEL;
 	c->lsave_cnt = 256;
 	c->leb_size = -1;
 	c->min_io_size = -1;
@@ -597,6 +859,17 @@ static int get_options(int argc, char**argv)
 			else if (strcmp(optarg, "lzo") != 0)
 				return err_msg("bad compressor name");
 			break;
+		case 'P':
+			c->favor_precheck = 1;
+			break;
+		case 'L':
+			c->compr_level = strtol(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg ||
+			    c->compr_level < MIN_COMPR_LEVEL ||
+			    c->compr_level > MAX_COMPR_LEVEL)
+				return err_msg("bad compression level '%s'",
+					       optarg);
+			break;
 		case 'X':
 			c->favor_percent = strtol(optarg, &endp, 0);
 			if (*endp != '\0' || endp == optarg ||
@@ -617,6 +890,32 @@ static int get_options(int argc, char**argv)
 		case 'U':
 			squash_owner = 1;
 			break;
+		case 'C':
+			compact = 1;
+			break;
+		case 'M':
+			manifest_file = optarg;
+			break;
+		case 'B':
+			base_image = optarg;
+			break;
+		case 'b':
+			base_manifest = optarg;
+			break;
+		case 'Z':
+			reproducible = 1;
+			break;
+		case 'K':
+			dedup_cache_size = get_bytes(optarg);
+			if (dedup_cache_size < 0)
+				return -1;
+			break;
+		case 'J':
+			compr_jobs = strtol(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg ||
+			    compr_jobs <= 0 || compr_jobs > MAX_COMPR_JOBS)
+				return err_msg("bad count of jobs '%s'", optarg);
+			break;
 		}
 	}
 
@@ -626,7 +925,31 @@ static int get_options(int argc, char**argv)
 	if (!output)
 		return err_msg("not output device or file specified");
 
+	if (reproducible && getenv("SOURCE_DATE_EPOCH")) {
+		const char *epoch = getenv("SOURCE_DATE_EPOCH");
+
+		clamp_time = strtoll(epoch, &endp, 10);
+		if (*endp != '\0' || endp == epoch || clamp_time < 0)
+			return err_msg("bad SOURCE_DATE_EPOCH '%s'", epoch);
+	}
+
+	if (!base_image != !base_manifest)
+		return err_msg("the base image and its manifest have to be "
+			       "specified together");
+	if (base_image) {
+		struct stat base_st;
+
+		if (stat(base_image, &base_st))
+			return sys_err_msg("bad base image '%s'", base_image);
+		if (!stat(output, &st) && st.st_dev == base_st.st_dev &&
+		    st.st_ino == base_st.st_ino)
+			return err_msg("the base image cannot be the output");
+	}
+
 	out_ubi = !open_ubi(output);
+	if (out_ubi && compact)
+		return err_msg("compact image cannot be written to an UBI "
+			       "volume");
 
 	if (out_ubi) {
 		c->min_io_size = c->di.min_io_size;
@@ -698,11 +1021,15 @@ static int get_options(int argc, char**argv)
 			printf("\tcompr:        none\n");
 			break;
 		}
+		printf("\tcompr_level:  %d (%s, zlib %d)\n", c->compr_level,
+		       lzo_compr_name(c->compr_level), c->compr_level);
 		printf("\tkeyhash:      %s\n", (c->key_hash == key_r5_hash) ?
 						"r5" : "test");
 		printf("\tfanout:       %d\n", c->fanout);
 		printf("\torph_lebs:    %d\n", c->orph_lebs);
 		printf("\tspace_fixup:  %d\n", c->space_fixup);
+		printf("\tjobs:         %d\n", compr_jobs);
+		printf("\tdedup_cache:  %lld\n", dedup_cache_size);
 	}
 
 	if (validate_options())
@@ -714,6 +1041,45 @@ static int get_options(int argc, char**argv)
 	return 0;
 }
 
+/**
+ * mix64 - the 64-bit finalizer of MurmurHash3.
+ * @h: value to mix
+ */
+static uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * hash_node - add a node to the image hash.
+ * @crc: node CRC, which covers the node contents and sequence number
+ * @len: node length
+ *
+ * The image hash is a 128-bit state updated like the MurmurHash3 x64_128 body,
+ * so every bit of the resulting UUID depends on all nodes.
+ */
+static void hash_node(uint32_t crc, int len)
+{
+	uint64_t k = ((uint64_t)crc << 32) | (uint32_t)len;
+
+	image_hash[0] ^= mix64(k);
+	image_hash[0] = rotl64(image_hash[0], 27) + image_hash[1];
+	image_hash[0] = image_hash[0] * 5 + 0x52dce729;
+	image_hash[1] ^= mix64(k ^ 0x9e3779b97f4a7c15ULL);
+	image_hash[1] = rotl64(image_hash[1], 31) + image_hash[0];
+	image_hash[1] = image_hash[1] * 5 + 0x38495ab5;
+}
+
 /**
  * prepare_node - fill in the common header.
  * @node: node
@@ -731,6 +1097,213 @@ static void prepare_node(void *node, int len)
 	ch->padding[0] = ch->padding[1] = 0;
 	crc = mtd_crc32(UBIFS_CRC32_INIT, node + 8, len - 8);
 	ch->crc = cpu_to_le32(crc);
+	if (reproducible)
+		hash_node(crc, len);
+}
+
+/**
+ * out_thread_func - output thread.
+ * @arg: not used
+ *
+ * The output thread writes queued LEBs to the output file. LEBs with
+ * consecutive numbers are written with one 'pwritev()' call, and the 0xff
+ * bytes at the end of LEBs are written from @ff_buf rather than copied.
+ */
+static void *out_thread_func(void *arg)
+{
+	struct iovec iov[OUT_QUEUE_LEBS * 2];
+	struct out_leb *ol;
+	ssize_t len, ret;
+	int i, n, iovcnt, err = 0;
+	off_t pos;
+
+	pthread_mutex_lock(&out_mutex);
+	while (1) {
+		while (!out_cnt && !out_exit)
+			pthread_cond_wait(&out_queued_cond, &out_mutex);
+		if (!out_cnt)
+			break;
+
+		/*
+		 * Take all the queued LEBs which are consecutive. In a compact
+		 * image LEBs are simply appended, so take all of them.
+		 */
+		ol = &out_queue[out_first];
+		for (n = 1; n < out_cnt; n++)
+			if (!compact && out_queue[(out_first + n) %
+					OUT_QUEUE_LEBS].lnum != ol->lnum + n)
+				break;
+		pthread_mutex_unlock(&out_mutex);
+
+		if (compact)
+			pos = compact_end;
+		else
+			pos = (off_t)ol->lnum * c->leb_size;
+		len = 0;
+		for (i = iovcnt = 0; i < n; i++) {
+			ol = &out_queue[(out_first + i) % OUT_QUEUE_LEBS];
+			if (ol->len) {
+				iov[iovcnt].iov_base = ol->buf;
+				iov[iovcnt++].iov_len = ol->len;
+			}
+			if (compact) {
+				compact_tbl[ol->lnum].offs = cpu_to_le64(pos + len);
+				compact_tbl[ol->lnum].len = cpu_to_le32(ol->len);
+				len += ol->len;
+			} else if (ol->len != c->leb_size) {
+				iov[iovcnt].iov_base = ff_buf;
+				iov[iovcnt++].iov_len = c->leb_size - ol->len;
+			}
+			if (!compact)
+				len += c->leb_size;
+		}
+		compact_end += len;
+		if (!err && iovcnt) {
+			ret = pwritev(out_fd, iov, iovcnt, pos);
+			if (ret != len) {
+				err = ret == -1 ? errno : EIO;
+				errno = err;
+				sys_err_msg("write failed writing %zd bytes at "
+					    "pos %"PRIdoff_t, len, pos);
+			}
+		}
+
+		pthread_mutex_lock(&out_mutex);
+		out_first = (out_first + n) % OUT_QUEUE_LEBS;
+		out_cnt -= n;
+		out_err = err;
+		pthread_cond_signal(&out_done_cond);
+	}
+	pthread_mutex_unlock(&out_mutex);
+
+	return arg;
+}
+
+/**
+ * start_out_thread - allocate the output queue and start the output thread.
+ */
+static int start_out_thread(void)
+{
+	int i, err;
+
+	out_bufs = malloc((size_t)OUT_QUEUE_LEBS * c->leb_size);
+	ff_buf = malloc(c->leb_size);
+	if (!out_bufs || !ff_buf)
+		return err_msg("out of memory");
+	memset(ff_buf, 0xff, c->leb_size);
+	for (i = 0; i < OUT_QUEUE_LEBS; i++)
+		out_queue[i].buf = out_bufs + (size_t)i * c->leb_size;
+
+	if (compact) {
+		/* Leave room for the header and LEB records, they go last */
+		compact_tbl = calloc(c->max_leb_cnt,
+				     sizeof(struct ubigen_compact_leb));
+		if (!compact_tbl)
+			return err_msg("out of memory");
+		compact_end = sizeof(struct ubigen_compact_hdr);
+		compact_end += c->max_leb_cnt *
+			       sizeof(struct ubigen_compact_leb);
+	}
+
+	err = pthread_create(&out_thread, NULL, out_thread_func, NULL);
+	if (err) {
+		errno = err;
+		return sys_err_msg("cannot create output thread");
+	}
+	out_thread_running = 1;
+	return 0;
+}
+
+/**
+ * write_compact_hdr - write the header and the LEB records of a compact image.
+ */
+static int write_compact_hdr(void)
+{
+	struct ubigen_compact_hdr hdr;
+	size_t sz = c->max_leb_cnt * sizeof(struct ubigen_compact_leb);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = cpu_to_le32(UBIGEN_COMPACT_MAGIC);
+	hdr.leb_size = cpu_to_le32(c->leb_size);
+	hdr.leb_cnt = cpu_to_le32(c->leb_cnt);
+	hdr.tbl_cnt = cpu_to_le32(c->max_leb_cnt);
+	hdr.tbl_crc = cpu_to_le32(mtd_crc32(UBI_CRC32_INIT, compact_tbl, sz));
+	hdr.hdr_crc = cpu_to_le32(mtd_crc32(UBI_CRC32_INIT, &hdr,
+					    UBIGEN_COMPACT_HDR_SIZE_CRC));
+
+	if (pwrite(out_fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+	    pwrite(out_fd, compact_tbl, sz, sizeof(hdr)) != (ssize_t)sz)
+		return sys_err_msg("cannot write compact image header");
+	return 0;
+}
+
+/**
+ * stop_out_thread - write out the output queue and stop the output thread.
+ *
+ * Returns %0 if all the queued LEBs were written and %-1 otherwise.
+ */
+static int stop_out_thread(void)
+{
+	int err;
+
+	if (out_thread_running) {
+		pthread_mutex_lock(&out_mutex);
+		out_exit = 1;
+		pthread_cond_signal(&out_queued_cond);
+		pthread_mutex_unlock(&out_mutex);
+		pthread_join(out_thread, NULL);
+		out_thread_running = 0;
+	}
+	err = out_err ? -1 : 0;
+	if (!err && compact_tbl)
+		err = write_compact_hdr();
+	free(compact_tbl);
+	free(ff_buf);
+	free(out_bufs);
+	compact_tbl = NULL;
+	ff_buf = out_bufs = NULL;
+	return err;
+}
+
+/**
+ * queue_leb - queue the image of a LEB for the output thread.
+ * @lnum: LEB number
+ * @len: length of data in the buffer
+ * @buf: buffer
+ */
+static int queue_leb(int lnum, int len, void *buf)
+{
+	struct out_leb *ol;
+	int err;
+
+	pthread_mutex_lock(&out_mutex);
+	while (out_cnt == OUT_QUEUE_LEBS && !out_err)
+		pthread_cond_wait(&out_done_cond, &out_mutex);
+	ol = &out_queue[(out_first + out_cnt) % OUT_QUEUE_LEBS];
+	err = out_err;
+	pthread_mutex_unlock(&out_mutex);
+	/* The output thread has already printed the error message */
+	if (err)
+		return -1;
+
+	if (compact && lnum >= c->max_leb_cnt)
+		return err_msg("max_leb_cnt too low (%d needed)", lnum + 1);
+
+	/* Compact images do not store 0xFF bytes at the end of LEBs */
+	if (compact)
+		while (len && ((uint8_t *)buf)[len - 1] == 0xFF)
+			len -= 1;
+
+	/* The output thread does not touch the buffer until it is queued */
+	memcpy(ol->buf, buf, len);
+	ol->lnum = lnum;
+	ol->len = len;
+
+	pthread_mutex_lock(&out_mutex);
+	out_cnt += 1;
+	pthread_cond_signal(&out_queued_cond);
+	pthread_mutex_unlock(&out_mutex);
+	return 0;
 }
 
 /**
@@ -738,12 +1311,18 @@ static void prepare_node(void *node, int len)
  * @lnum: LEB number
  * @len: length of data in the buffer
  * @buf: buffer (must be at least c->leb_size bytes)
+ *
+ * When the output target is a file, the LEB is only queued for writing, and
+ * the buffer may be re-used as soon as this function returns.
  */
 int write_leb(int lnum, int len, void *buf)
 {
 	off_t pos = (off_t)lnum * c->leb_size;
 
 	dbg_msg(3, "LEB %d len %d", lnum, len);
+	if (out_thread_running)
+		return queue_leb(lnum, len, buf);
+
 	memset(buf + len, 0xff, c->leb_size - len);
 	if (out_ubi)
 		if (ubi_leb_change_start(ubi, out_fd, lnum, c->leb_size))
@@ -904,22 +1483,24 @@ static int add_to_index(union ubifs_key *key, char *name, int lnum, int offs,
 	struct idx_entry *e;
 
 	dbg_msg(3, "LEB %d offs %d len %d", lnum, offs, len);
-	e = malloc(sizeof(struct idx_entry));
-	if (!e)
-		return err_msg("out of memory");
-	e->next = NULL;
-	e->prev = idx_list_last;
+	if (idx_cnt == idx_max) {
+		size_t max = idx_max ? idx_max * 2 : IDX_ENTRIES_INIT;
+
+		if (max * sizeof(struct idx_entry) / max !=
+		    sizeof(struct idx_entry))
+			return err_msg("index is too big (%zu entries)", max);
+		e = realloc(idx_entries, max * sizeof(struct idx_entry));
+		if (!e)
+			return err_msg("out of memory");
+		idx_entries = e;
+		idx_max = max;
+	}
+	e = &idx_entries[idx_cnt++];
 	e->key = *key;
 	e->name = name;
 	e->lnum = lnum;
 	e->offs = offs;
 	e->len = len;
-	if (!idx_list_first)
-		idx_list_first = e;
-	if (idx_list_last)
-		idx_list_last->next = e;
-	idx_list_last = e;
-	idx_cnt += 1;
 	return 0;
 }
 
@@ -982,9 +1563,7 @@ static int add_node(union ubifs_key *key, char *name, void *node, int len)
 	memcpy(leb_buf + offs, node, len);
 	memset(leb_buf + offs + len, 0xff, ALIGN(len, 8) - len);
 
-	add_to_index(key, name, lnum, offs, len);
-
-	return 0;
+	return add_to_index(key, name, lnum, offs, len);
 }
 
 /**
@@ -1027,9 +1606,22 @@ static int add_inode_with_data(struct stat *st, ino_t inum, void *data,
 	 * The time fields are updated assuming the default time granularity
 	 * of 1 second. To support finer granularities, utime() would be needed.
 	 */
-	ino->atime_sec  = cpu_to_le64(st->st_atime);
-	ino->ctime_sec  = cpu_to_le64(st->st_ctime);
-	ino->mtime_sec  = cpu_to_le64(st->st_mtime);
+	if (reproducible) {
+		/*
+		 * Access and change times change when the tree is read or
+		 * copied, so only the modification time is used.
+		 */
+		long long t = st->st_mtime;
+
+		if (clamp_time != -1 && t > clamp_time)
+			t = clamp_time;
+		ino->atime_sec = ino->ctime_sec = ino->mtime_sec =
+							cpu_to_le64(t);
+	} else {
+		ino->atime_sec  = cpu_to_le64(st->st_atime);
+		ino->ctime_sec  = cpu_to_le64(st->st_ctime);
+		ino->mtime_sec  = cpu_to_le64(st->st_mtime);
+	}
 	ino->atime_nsec = 0;
 	ino->ctime_nsec = 0;
 	ino->mtime_nsec = 0;
@@ -1071,22 +1663,11 @@ static int add_inode(struct stat *st, ino_t inum, int flags)
  * is being created does not exist at the host file system, but is defined by
  * the device table.
  */
-static int add_dir_inode(DIR *dir, ino_t inum, loff_t size, unsigned int nlink,
-			 struct stat *st)
+static int add_dir_inode(ino_t inum, loff_t size, unsigned int nlink,
+			 struct stat *st, int flags)
 {
-	int fd, flags = 0;
-
 	st->st_size = size;
 	st->st_nlink = nlink;
-
-	if (dir) {
-		fd = dirfd(dir);
-		if (fd == -1)
-			return sys_err_msg("dirfd failed");
-		if (ioctl(fd, FS_IOC_GETFLAGS, &flags) == -1)
-			flags = 0;
-	}
-
 	return add_inode(st, inum, flags);
 }
 
@@ -1170,6 +1751,49 @@ static int add_dent_node(ino_t dir_inum, const char *name, ino_t inum,
 	return add_node(&key, kname, dent, len);
 }
 
+/**
+ * inum_hash - hash a source inode for the link counting hash table.
+ * @dev: source device on which source inode number resides
+ * @inum: source inode number
+ */
+static size_t inum_hash(dev_t dev, ino_t inum)
+{
+	return mix64((uint64_t)inum ^ ((uint64_t)dev << 32));
+}
+
+/**
+ * inum_mapping - get an inode mapping by its allocation number.
+ * @n: allocation number
+ */
+static struct inum_mapping *inum_mapping(size_t n)
+{
+	return &im_chunks[n / INUM_MAPPINGS_CHUNK][n % INUM_MAPPINGS_CHUNK];
+}
+
+/**
+ * grow_hash_table - double the size of the link counting hash table.
+ */
+static int grow_hash_table(void)
+{
+	struct inum_mapping **table, *im;
+	size_t i, k, size = hash_table_size * 2;
+
+	table = calloc(size, sizeof(struct inum_mapping *));
+	if (!table)
+		return -1;
+	for (i = 0; i < im_cnt; i++) {
+		im = inum_mapping(i);
+		k = inum_hash(im->dev, im->inum) & (size - 1);
+		while (table[k])
+			k = (k + 1) & (size - 1);
+		table[k] = im;
+	}
+	free(hash_table);
+	hash_table = table;
+	hash_table_size = size;
+	return 0;
+}
+
 /**
  * lookup_inum_mapping - add an inode mapping for link counting.
  * @dev: source device on which source inode number resides
@@ -1177,28 +1801,45 @@ static int add_dent_node(ino_t dir_inum, const char *name, ino_t inum,
  */
 static struct inum_mapping *lookup_inum_mapping(dev_t dev, ino_t inum)
 {
-	struct inum_mapping *im;
-	unsigned int k;
-
-	k = inum % HASH_TABLE_SIZE;
-	im = hash_table[k];
-	while (im) {
+	struct inum_mapping *im, **chunks;
+	unsigned int probes = 1;
+	size_t k;
+
+	im_lookups += 1;
+	k = inum_hash(dev, inum) & (hash_table_size - 1);
+	for (; hash_table[k]; k = (k + 1) & (hash_table_size - 1)) {
+		im = hash_table[k];
 		if (im->dev == dev && im->inum == inum)
-			return im;
-		im = im->next;
+			break;
+		probes += 1;
 	}
-	im = malloc(sizeof(struct inum_mapping));
-	if (!im)
-		return NULL;
-	im->next = hash_table[k];
-	im->prev = NULL;
+	im_probes += probes;
+	if (probes > im_max_probes)
+		im_max_probes = probes;
+	if (hash_table[k])
+		return hash_table[k];
+
+	if (im_cnt % INUM_MAPPINGS_CHUNK == 0) {
+		chunks = realloc(im_chunks, (im_cnt / INUM_MAPPINGS_CHUNK + 1) *
+				 sizeof(struct inum_mapping *));
+		if (!chunks)
+			return NULL;
+		im_chunks = chunks;
+		im = malloc(INUM_MAPPINGS_CHUNK * sizeof(struct inum_mapping));
+		if (!im)
+			return NULL;
+		im_chunks[im_cnt / INUM_MAPPINGS_CHUNK] = im;
+	}
+	im = inum_mapping(im_cnt++);
 	im->dev = dev;
 	im->inum = inum;
 	im->use_inum = 0;
 	im->use_nlink = 0;
-	if (hash_table[k])
-		hash_table[k]->prev = im;
+	im->path_name = NULL;
 	hash_table[k] = im;
+
+	if (im_cnt * 2 > hash_table_size && grow_hash_table())
+		return NULL;
 	return im;
 }
 
@@ -1210,13 +1851,304 @@ static struct inum_mapping *lookup_inum_mapping(dev_t dev, ino_t inum)
 static int all_zero(void *buf, int len)
 {
 	unsigned char *p = buf;
+	const unsigned long *w;
+
+	while (len && ((unsigned long)p & (sizeof(long) - 1))) {
+		if (*p++ != 0)
+			return 0;
+		len -= 1;
+	}
+
+	/* Check 4 words at a time, the compiler may vectorize this */
+	w = (const unsigned long *)p;
+	while (len >= 4 * (int)sizeof(long)) {
+		if (w[0] | w[1] | w[2] | w[3])
+			return 0;
+		w += 4;
+		len -= 4 * sizeof(long);
+	}
 
+	p = (unsigned char *)w;
 	while (len--)
 		if (*p++ != 0)
 			return 0;
 	return 1;
 }
 
+/**
+ * skip_holes - skip file holes without reading them.
+ * @fd: file descriptor
+ * @pos: block aligned file position, returns the position of the next block
+ *       containing data
+ * @hole: offset of the hole following the data is returned here
+ *
+ * This function uses 'SEEK_DATA' and 'SEEK_HOLE' to find the data of a sparse
+ * file and leaves the file offset at @pos. If the file system does not support
+ * them, the whole file is treated as data. Returns %0 on success, %1 if there
+ * is no more data in the file (@pos is then the file size) and %-1 on error.
+ */
+static int skip_holes(int fd, loff_t *pos, loff_t *hole)
+{
+	loff_t data;
+
+	data = lseek(fd, *pos, SEEK_DATA);
+	if (data == -1) {
+		if (errno == ENXIO) {
+			/* There is only a hole up to the end of file */
+			data = lseek(fd, 0, SEEK_END);
+			if (data == -1)
+				return -1;
+			*pos = data;
+			return 1;
+		}
+		if (errno != EINVAL)
+			return -1;
+		*hole = LLONG_MAX;
+		return 0;
+	}
+
+	data &= ~(loff_t)(UBIFS_BLOCK_SIZE - 1);
+	*hole = lseek(fd, data, SEEK_HOLE);
+	if (*hole == -1 || lseek(fd, data, SEEK_SET) == -1)
+		return -1;
+	*pos = data;
+	return 0;
+}
+
+/**
+ * dedup_slot - get the dedup cache slot of a data block.
+ * @db: data block
+ */
+static struct dedup_entry *dedup_slot(struct data_block *db)
+{
+	uint32_t k = db->hash ^ ((uint32_t)db->use_compr * 0x9e3779b9);
+
+	return &dedup_cache[k % dedup_slots];
+}
+
+/**
+ * dedup_lookup - look a data block up in the dedup cache.
+ * @db: data block (with its hash calculated)
+ *
+ * This function returns %1 and fills in the compressed data of @db if the
+ * same data have already been compressed with the same compressor, otherwise
+ * %0 is returned.
+ */
+static int dedup_lookup(struct data_block *db)
+{
+	struct dedup_entry *e;
+
+	if (!dedup_slots || db->use_compr == UBIFS_COMPR_NONE)
+		return 0;
+
+	dedup_lookups += 1;
+	e = dedup_slot(db);
+	if (e->len != db->len || e->hash != db->hash ||
+	    e->use_compr != db->use_compr || memcmp(e->data, db->buf, db->len))
+		return 0;
+
+	dedup_hits += 1;
+	db->compr_type = e->compr_type;
+	db->out_len = e->out_len;
+	memcpy(&db->dn->data, e->cdata, e->out_len);
+	return 1;
+}
+
+/**
+ * dedup_insert - add a compressed data block to the dedup cache.
+ * @db: data block
+ *
+ * The block replaces whatever was in its cache slot.
+ */
+static void dedup_insert(struct data_block *db)
+{
+	struct dedup_entry *e;
+
+	if (!dedup_slots || db->use_compr == UBIFS_COMPR_NONE || db->cached ||
+	    db->out_len > UBIFS_BLOCK_SIZE)
+		return;
+
+	e = dedup_slot(db);
+	e->hash = db->hash;
+	e->use_compr = db->use_compr;
+	e->compr_type = db->compr_type;
+	e->len = db->len;
+	e->out_len = db->out_len;
+	memcpy(e->data, db->buf, db->len);
+	memcpy(e->cdata, &db->dn->data, db->out_len);
+}
+
+/**
+ * init_dedup_cache - allocate the dedup cache.
+ *
+ * The cache gets as many slots as fit in the size given by the
+ * "--dedup-cache" option. The memory is only touched as slots are used, so
+ * a small image does not pay for a big cache.
+ */
+static int init_dedup_cache(void)
+{
+	dedup_slots = dedup_cache_size / sizeof(struct dedup_entry);
+	if (!dedup_slots)
+		return 0;
+	dedup_cache = calloc(dedup_slots, sizeof(struct dedup_entry));
+	if (!dedup_cache)
+		return err_msg("out of memory");
+	return 0;
+}
+
+/**
+ * free_dedup_cache - free the dedup cache and print its statistics.
+ */
+static void free_dedup_cache(void)
+{
+	if (verbose && dedup_lookups)
+		printf("\tdedup hits:   %llu of %llu blocks (%llu%%)\n",
+		       dedup_hits, dedup_lookups,
+		       dedup_hits * 100 / dedup_lookups);
+	free(dedup_cache);
+	dedup_cache = NULL;
+	dedup_slots = 0;
+}
+
+/**
+ * compress_block - compress a data block into its data node.
+ * @ctx: compressor context to use
+ * @db: data block to compress
+ */
+static void compress_block(struct compr_ctx *ctx, struct data_block *db)
+{
+	if (db->cached)
+		return;
+	db->out_len = NODE_BUFFER_SIZE - UBIFS_DATA_NODE_SZ;
+	db->compr_type = compress_data(ctx, db->buf, db->len, &db->dn->data,
+				       &db->out_len, db->use_compr);
+}
+
+/**
+ * compr_thread - compression thread.
+ * @arg: not used
+ *
+ * Compression threads pick data blocks of the current batch one by one until
+ * the batch is exhausted, then wait for the next batch.
+ */
+static void *compr_thread(void *arg)
+{
+	struct compr_ctx *ctx;
+	int i;
+
+	ctx = init_compr_ctx();
+
+	pthread_mutex_lock(&batch_mutex);
+	if (!ctx)
+		compr_threads_err = 1;
+	while (ctx) {
+		while (!compr_threads_exit && batch_next >= batch_cnt)
+			pthread_cond_wait(&batch_work_cond, &batch_mutex);
+		if (compr_threads_exit)
+			break;
+		i = batch_next++;
+		pthread_mutex_unlock(&batch_mutex);
+
+		compress_block(ctx, &batch[i]);
+
+		pthread_mutex_lock(&batch_mutex);
+		if (++batch_done == batch_cnt)
+			pthread_cond_signal(&batch_done_cond);
+	}
+	pthread_mutex_unlock(&batch_mutex);
+
+	destroy_compr_ctx(ctx);
+	return arg;
+}
+
+/**
+ * compress_batch - compress all data blocks of the current batch.
+ * @cnt: count of data blocks in the batch
+ */
+static int compress_batch(int cnt)
+{
+	int i, err;
+
+	if (!compr_threads_cnt) {
+		for (i = 0; i < cnt; i++)
+			compress_block(compr_ctx, &batch[i]);
+		return 0;
+	}
+
+	pthread_mutex_lock(&batch_mutex);
+	batch_cnt = cnt;
+	batch_next = batch_done = 0;
+	pthread_cond_broadcast(&batch_work_cond);
+	while (batch_done < cnt && !compr_threads_err)
+		pthread_cond_wait(&batch_done_cond, &batch_mutex);
+	/* Make sure idle threads do not pick the blocks of this batch again */
+	batch_cnt = 0;
+	err = compr_threads_err;
+	pthread_mutex_unlock(&batch_mutex);
+
+	if (err)
+		return err_msg("compression thread failed");
+	return 0;
+}
+
+/**
+ * start_compr_threads - allocate the data block batch and start compression
+ *                       threads.
+ */
+static int start_compr_threads(void)
+{
+	int i, err;
+
+	batch_size = compr_jobs > 1 ? compr_jobs * COMPR_BATCH_BLOCKS : 1;
+	batch = calloc(batch_size, sizeof(struct data_block));
+	batch_bufs = malloc((size_t)batch_size * UBIFS_BLOCK_SIZE);
+	batch_dns = malloc((size_t)batch_size * NODE_BUFFER_SIZE);
+	if (!batch || !batch_bufs || !batch_dns)
+		return err_msg("out of memory");
+	for (i = 0; i < batch_size; i++) {
+		batch[i].buf = batch_bufs + (size_t)i * UBIFS_BLOCK_SIZE;
+		batch[i].dn = batch_dns + (size_t)i * NODE_BUFFER_SIZE;
+	}
+
+	if (compr_jobs == 1)
+		return 0;
+
+	compr_threads = calloc(compr_jobs, sizeof(pthread_t));
+	if (!compr_threads)
+		return err_msg("out of memory");
+	for (i = 0; i < compr_jobs; i++) {
+		err = pthread_create(&compr_threads[i], NULL, compr_thread,
+				     NULL);
+		if (err) {
+			errno = err;
+			return sys_err_msg("cannot create compression thread");
+		}
+		compr_threads_cnt += 1;
+	}
+	return 0;
+}
+
+/**
+ * stop_compr_threads - stop compression threads and free the data block
+ *                      batch.
+ */
+static void stop_compr_threads(void)
+{
+	int i;
+
+	pthread_mutex_lock(&batch_mutex);
+	compr_threads_exit = 1;
+	pthread_cond_broadcast(&batch_work_cond);
+	pthread_mutex_unlock(&batch_mutex);
+	for (i = 0; i < compr_threads_cnt; i++)
+		pthread_join(compr_threads[i], NULL);
+	compr_threads_cnt = 0;
+	free(compr_threads);
+	free(batch_dns);
+	free(batch_bufs);
+	free(batch);
+}
+
 /**
  * add_file - write the data of a file and its inode to the output file.
  * @path_name: source path name
@@ -1227,63 +2159,115 @@ static int all_zero(void *buf, int len)
 static int add_file(const char *path_name, struct stat *st, ino_t inum,
 		    int flags)
 {
-	struct ubifs_data_node *dn = node_buf;
-	void *buf = block_buf;
-	loff_t file_size = 0;
+	struct data_block *db;
+	struct ubifs_data_node *dn;
+	struct base_file *bf = NULL;
+	struct idx_entry *ie;
+	loff_t file_size = 0, hole = 0;
 	ssize_t ret, bytes_read;
 	union ubifs_key key;
-	int fd, dn_len, err, compr_type, use_compr;
+	int fd, dn_len, err, use_compr, cnt, i, eof = 0;
 	unsigned int block_no = 0;
-	size_t out_len;
+
+	if (c->default_compr == UBIFS_COMPR_NONE && (flags & FS_COMPR_FL))
+		use_compr = UBIFS_COMPR_LZO;
+	else
+		use_compr = c->default_compr;
+
+	err = manifest_add_file(path_name + root_len, st);
+	if (err)
+		return err;
+	if (use_compr != UBIFS_COMPR_NONE)
+		bf = base_find_file(path_name + root_len, st);
 
 	fd = open(path_name, O_RDONLY | O_LARGEFILE);
 	if (fd == -1)
 		return sys_err_msg("failed to open file '%s'", path_name);
-	do {
-		/* Read next block */
-		bytes_read = 0;
-		do {
-			ret = read(fd, buf + bytes_read,
-				   UBIFS_BLOCK_SIZE - bytes_read);
-			if (ret == -1) {
-				sys_err_msg("failed to read file '%s'",
-					    path_name);
-				close(fd);
-				return 1;
+	while (!eof) {
+		/* Read the next batch of blocks */
+		for (cnt = 0; cnt < batch_size && !eof; ) {
+			if (file_size >= hole) {
+				err = skip_holes(fd, &file_size, &hole);
+				if (err == -1) {
+					sys_err_msg("failed to seek file '%s'",
+						    path_name);
+					close(fd);
+					return 1;
+				}
+				if (err) {
+					eof = 1;
+					break;
+				}
+				block_no = file_size >> UBIFS_BLOCK_SHIFT;
 			}
-			bytes_read += ret;
-		} while (ret != 0 && bytes_read != UBIFS_BLOCK_SIZE);
-		if (bytes_read == 0)
-			break;
-		file_size += bytes_read;
-		/* Skip holes */
-		if (all_zero(buf, bytes_read)) {
-			block_no += 1;
-			continue;
+			db = &batch[cnt];
+			bytes_read = 0;
+			do {
+				ret = read(fd, db->buf + bytes_read,
+					   UBIFS_BLOCK_SIZE - bytes_read);
+				if (ret == -1) {
+					sys_err_msg("failed to read file '%s'",
+						    path_name);
+					close(fd);
+					return 1;
+				}
+				bytes_read += ret;
+			} while (ret != 0 && bytes_read != UBIFS_BLOCK_SIZE);
+			eof = (ret == 0);
+			if (bytes_read == 0)
+				break;
+			file_size += bytes_read;
+			/* Skip holes */
+			if (all_zero(db->buf, bytes_read)) {
+				block_no += 1;
+				continue;
+			}
+			db->block_no = block_no++;
+			db->len = bytes_read;
+			db->use_compr = use_compr;
+			if (use_compr != UBIFS_COMPR_NONE || manifest_file)
+				db->hash = mtd_crc32(0, db->buf, db->len);
+			db->cached = dedup_lookup(db) ||
+				     (bf && base_get_block(bf, db->block_no,
+						db->buf, db->len, db->hash,
+						use_compr,
+						&db->dn->data, &db->out_len,
+						&db->compr_type));
+			cnt += 1;
 		}
-		/* Make data node */
-		memset(dn, 0, UBIFS_DATA_NODE_SZ);
-		data_key_init(&key, inum, block_no++);
-		dn->ch.node_type = UBIFS_DATA_NODE;
-		key_write(&key, &dn->key);
-		dn->size = cpu_to_le32(bytes_read);
-		out_len = NODE_BUFFER_SIZE - UBIFS_DATA_NODE_SZ;
-		if (c->default_compr == UBIFS_COMPR_NONE &&
-		    (flags & FS_COMPR_FL))
-			use_compr = UBIFS_COMPR_LZO;
-		else
-			use_compr = c->default_compr;
-		compr_type = compress_data(buf, bytes_read, &dn->data,
-					   &out_len, use_compr);
-		dn->compr_type = cpu_to_le16(compr_type);
-		dn_len = UBIFS_DATA_NODE_SZ + out_len;
-		/* Add data node to file system */
-		err = add_node(&key, NULL, dn, dn_len);
+
+		err = compress_batch(cnt);
 		if (err) {
 			close(fd);
 			return err;
 		}
-	} while (ret != 0);
+
+		/* Add data nodes to file system in block order */
+		for (i = 0; i < cnt; i++) {
+			db = &batch[i];
+			dedup_insert(db);
+			dn = db->dn;
+			memset(dn, 0, UBIFS_DATA_NODE_SZ);
+			data_key_init(&key, inum, db->block_no);
+			dn->ch.node_type = UBIFS_DATA_NODE;
+			key_write(&key, &dn->key);
+			dn->size = cpu_to_le32(db->len);
+			dn->compr_type = cpu_to_le16(db->compr_type);
+			dn_len = UBIFS_DATA_NODE_SZ + db->out_len;
+			err = add_node(&key, NULL, dn, dn_len);
+			if (!err) {
+				/* The node position is in its index entry */
+				ie = &idx_entries[idx_cnt - 1];
+				err = manifest_add_block(db->block_no, db->len,
+						db->hash, db->use_compr,
+						ie->lnum, ie->offs, dn_len);
+			}
+			if (err) {
+				close(fd);
+				return err;
+			}
+		}
+	}
 	if (close(fd) == -1)
 		return sys_err_msg("failed to close file '%s'", path_name);
 	if (file_size != st->st_size)
@@ -1384,21 +2368,233 @@ static int add_non_dir(const char *path_name, ino_t *inum, unsigned int nlink,
 	return err_msg("file '%s' has unknown inode type", path_name);
 }
 
+/**
+ * new_scan_dir - allocate a directory for the directory scan.
+ * @path: directory path name
+ */
+static struct scan_dir *new_scan_dir(const char *path)
+{
+	struct scan_dir *sd;
+
+	sd = calloc(1, sizeof(struct scan_dir));
+	if (!sd)
+		return NULL;
+	sd->path = strdup(path);
+	if (!sd->path) {
+		free(sd);
+		return NULL;
+	}
+	return sd;
+}
+
+/**
+ * free_scan_dir - free a scanned directory tree.
+ * @sd: the scanned directory
+ */
+static void free_scan_dir(struct scan_dir *sd)
+{
+	int i;
+
+	if (!sd)
+		return;
+	for (i = 0; i < sd->cnt; i++) {
+		free(sd->dents[i].name);
+		free_scan_dir(sd->dents[i].dir);
+	}
+	free(sd->dents);
+	free(sd->path);
+	free(sd);
+}
+
+/* Comparison function used for sorting directory entries by name */
+static int cmp_dent(const void *a, const void *b)
+{
+	const struct scan_dent *da = a, *db = b;
+
+	return strcmp(da->name, db->name);
+}
+
+/**
+ * scan_one_dir - read a directory and stat its entries.
+ * @sd: the directory to scan
+ *
+ * The entries are stat'ed relative to the directory file descriptor, which
+ * saves a path name lookup per entry. Subdirectories are queued for scanning.
+ * Errors are recorded in @sd and @sd->dents and reported when the directory
+ * is added to the image. In reproducible mode the entries are sorted by name.
+ */
+static void scan_one_dir(struct scan_dir *sd)
+{
+	struct scan_dir *subdirs = NULL, *last = NULL;
+	struct scan_dent *dent, *dents;
+	char *path;
+	struct dirent *entry;
+	DIR *dir;
+	int fd, cnt = 0;
+
+	dir = opendir(sd->path);
+	if (!dir) {
+		sd->err = errno;
+		sd->err_op = "open";
+		return;
+	}
+	fd = dirfd(dir);
+	if (ioctl(fd, FS_IOC_GETFLAGS, &sd->flags) == -1)
+		sd->flags = 0;
+
+	while (1) {
+		errno = 0;
+		entry = readdir(dir);
+		if (!entry) {
+			if (errno) {
+				sd->err = errno;
+				sd->err_op = "read";
+			}
+			break;
+		}
+
+		if (strcmp(".", entry->d_name) == 0)
+			continue;
+		if (strcmp("..", entry->d_name) == 0)
+			continue;
+
+		if (sd->cnt == sd->max) {
+			sd->max = sd->max ? sd->max * 2 : 16;
+			dents = realloc(sd->dents,
+					sd->max * sizeof(struct scan_dent));
+			if (!dents)
+				goto out_nomem;
+			sd->dents = dents;
+		}
+		dent = &sd->dents[sd->cnt];
+		memset(dent, 0, sizeof(struct scan_dent));
+		dent->name = strdup(entry->d_name);
+		if (!dent->name)
+			goto out_nomem;
+		sd->cnt += 1;
+
+		if (fstatat(fd, entry->d_name, &dent->st,
+			    AT_SYMLINK_NOFOLLOW) == -1) {
+			dent->err = errno;
+			continue;
+		}
+		if (!S_ISDIR(dent->st.st_mode))
+			continue;
+
+		path = make_path(sd->path, entry->d_name);
+		if (path)
+			dent->dir = new_scan_dir(path);
+		free(path);
+		if (!dent->dir)
+			goto out_nomem;
+		if (last)
+			last->next = dent->dir;
+		else
+			subdirs = dent->dir;
+		last = dent->dir;
+		cnt += 1;
+	}
+
+	if (closedir(dir) == -1 && !sd->err) {
+		sd->err = errno;
+		sd->err_op = "close";
+	}
+	if (reproducible)
+		qsort(sd->dents, sd->cnt, sizeof(struct scan_dent), cmp_dent);
+	goto out;
+
+out_nomem:
+	closedir(dir);
+	sd->err = ENOMEM;
+	sd->err_op = "read";
+out:
+	if (!subdirs)
+		return;
+	pthread_mutex_lock(&scan_mutex);
+	last->next = scan_queue;
+	scan_queue = subdirs;
+	scan_pending += cnt;
+	pthread_cond_broadcast(&scan_cond);
+	pthread_mutex_unlock(&scan_mutex);
+}
+
+/**
+ * scan_thread - directory scan thread.
+ * @arg: not used
+ *
+ * Scan threads take directories from the scan queue until all directories of
+ * the tree have been scanned.
+ */
+static void *scan_thread(void *arg)
+{
+	struct scan_dir *sd;
+
+	pthread_mutex_lock(&scan_mutex);
+	while (1) {
+		while (!scan_queue && scan_pending)
+			pthread_cond_wait(&scan_cond, &scan_mutex);
+		if (!scan_queue)
+			break;
+		sd = scan_queue;
+		scan_queue = sd->next;
+		sd->next = NULL;
+		pthread_mutex_unlock(&scan_mutex);
+
+		scan_one_dir(sd);
+
+		pthread_mutex_lock(&scan_mutex);
+		scan_pending -= 1;
+		if (!scan_pending)
+			pthread_cond_broadcast(&scan_cond);
+	}
+	pthread_mutex_unlock(&scan_mutex);
+	return arg;
+}
+
+/**
+ * scan_tree - scan a source directory tree.
+ * @path: root directory path name
+ *
+ * This function scans the directory tree using as many threads as there are
+ * compression jobs and returns the scanned tree or %NULL if out of memory.
+ */
+static struct scan_dir *scan_tree(const char *path)
+{
+	struct scan_dir *sd;
+	pthread_t *threads;
+	int i, cnt = 0;
+
+	sd = new_scan_dir(path);
+	if (!sd)
+		return NULL;
+	scan_queue = sd;
+	scan_pending = 1;
+
+	threads = calloc(compr_jobs, sizeof(pthread_t));
+	for (i = 1; threads && i < compr_jobs; i++, cnt++)
+		if (pthread_create(&threads[cnt], NULL, scan_thread, NULL))
+			break;
+	scan_thread(NULL);
+	for (i = 0; i < cnt; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	return sd;
+}
+
 /**
  * add_directory - write a directory tree to the output file.
  * @dir_name: directory path name
+ * @sd: the scanned directory or %NULL if this function is called for a
+ *      directory which does not exist on the host file-system and it is being
+ *      created because it is defined in the device table file.
  * @dir_inum: UBIFS inode number of directory
  * @st: directory inode statistics
- * @non_existing: non-zero if this function is called for a directory which
- *                does not exist on the host file-system and it is being
- *                created because it is defined in the device table file.
  */
-static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
-			 int non_existing)
+static int add_directory(const char *dir_name, struct scan_dir *sd,
+			 ino_t dir_inum, struct stat *st)
 {
-	struct dirent *entry;
-	DIR *dir = NULL;
-	int err = 0;
+	struct scan_dent *dent;
+	int i, err = 0;
 	loff_t size = UBIFS_INO_NODE_SZ;
 	char *name = NULL;
 	unsigned int nlink = 2;
@@ -1410,11 +2606,10 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 	unsigned long long dir_creat_sqnum = ++c->max_sqnum;
 
 	dbg_msg(2, "%s", dir_name);
-	if (!non_existing) {
-		dir = opendir(dir_name);
-		if (dir == NULL)
-			return sys_err_msg("cannot open directory '%s'",
-					   dir_name);
+	if (sd && sd->err) {
+		errno = sd->err;
+		return sys_err_msg("cannot %s directory '%s'", sd->err_op,
+				   dir_name);
 	}
 
 	/*
@@ -1428,45 +2623,33 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 	 * Before adding the directory itself, we have to iterate over all the
 	 * entries the device table adds to this directory and create them.
 	 */
-	for (; !non_existing;) {
+	for (i = 0; sd && i < sd->cnt; i++) {
 		struct stat dent_st;
 
-		errno = 0;
-		entry = readdir(dir);
-		if (!entry) {
-			if (errno == 0)
-				break;
-			sys_err_msg("error reading directory '%s'", dir_name);
-			err = -1;
-			break;
-		}
-
-		if (strcmp(".", entry->d_name) == 0)
-			continue;
-		if (strcmp("..", entry->d_name) == 0)
-			continue;
-
+		dent = &sd->dents[i];
 		if (ph_elt)
 			/*
 			 * This directory was referred to at the device table
 			 * file. Check if this directory entry is referred at
 			 * too.
 			 */
-			nh_elt = devtbl_find_name(ph_elt, entry->d_name);
+			nh_elt = devtbl_find_name(ph_elt, dent->name);
 
 		/*
 		 * We are going to create the file corresponding to this
-		 * directory entry (@entry->d_name). We use 'struct stat'
+		 * directory entry (@dent->name). We use 'struct stat'
 		 * object to pass information about file attributes (actually
-		 * only about UID, GID, mode, major, and minor). Get attributes
-		 * for this file from the UBIFS rootfs on the host.
+		 * only about UID, GID, mode, major, and minor). The attributes
+		 * of this file on the host were got by the directory scan.
 		 */
 		free(name);
-		name = make_path(dir_name, entry->d_name);
-		if (lstat(name, &dent_st) == -1) {
+		name = make_path(dir_name, dent->name);
+		if (dent->err) {
+			errno = dent->err;
 			sys_err_msg("lstat failed for file '%s'", name);
 			goto out_free;
 		}
+		dent_st = dent->st;
 
 		if (squash_owner)
 			/*
@@ -1486,7 +2669,7 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 		inum = ++c->highest_inum;
 
 		if (S_ISDIR(dent_st.st_mode)) {
-			err = add_directory(name, inum, &dent_st, 0);
+			err = add_directory(name, dent->dir, inum, &dent_st);
 			if (err)
 				goto out_free;
 			nlink += 1;
@@ -1497,11 +2680,10 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 				goto out_free;
 		}
 
-		err = add_dent_node(dir_inum, entry->d_name, inum, type);
+		err = add_dent_node(dir_inum, dent->name, inum, type);
 		if (err)
 			goto out_free;
-		size += ALIGN(UBIFS_DENT_NODE_SZ + strlen(entry->d_name) + 1,
-			      8);
+		size += ALIGN(UBIFS_DENT_NODE_SZ + strlen(dent->name) + 1, 8);
 	}
 
 	/*
@@ -1538,7 +2720,7 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 		inum = ++c->highest_inum;
 
 		if (S_ISDIR(nh_elt->mode)) {
-			err = add_directory(name, inum, &fake_st, 1);
+			err = add_directory(name, NULL, inum, &fake_st);
 			if (err)
 				goto out_free;
 			nlink += 1;
@@ -1559,41 +2741,38 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 
 	creat_sqnum = dir_creat_sqnum;
 
-	err = add_dir_inode(dir, dir_inum, size, nlink, st);
+	err = add_dir_inode(dir_inum, size, nlink, st, sd ? sd->flags : 0);
 	if (err)
 		goto out_free;
 
 	free(name);
-	if (!non_existing && closedir(dir) == -1)
-		return sys_err_msg("error closing directory '%s'", dir_name);
-
 	return 0;
 
 out_free:
 	free(name);
-	if (!non_existing)
-		closedir(dir);
 	return -1;
 }
 
 /**
  * add_multi_linked_files - write all the files for which we counted links.
+ *
+ * The files are written in the order they were found, which is also target
+ * inode number order.
  */
 static int add_multi_linked_files(void)
 {
-	int i, err;
-
-	for (i = 0; i < HASH_TABLE_SIZE; i++) {
-		struct inum_mapping *im;
-		unsigned char type = 0;
+	struct inum_mapping *im;
+	unsigned char type = 0;
+	size_t i;
+	int err;
 
-		for (im = hash_table[i]; im; im = im->next) {
-			dbg_msg(2, "%s", im->path_name);
-			err = add_non_dir(im->path_name, &im->use_inum,
-					  im->use_nlink, &type, &im->st);
-			if (err)
-				return err;
-		}
+	for (i = 0; i < im_cnt; i++) {
+		im = inum_mapping(i);
+		dbg_msg(2, "%s", im->path_name);
+		err = add_non_dir(im->path_name, &im->use_inum,
+				  im->use_nlink, &type, &im->st);
+		if (err)
+			return err;
 	}
 	return 0;
 }
@@ -1603,6 +2782,7 @@ static int add_multi_linked_files(void)
  */
 static int write_data(void)
 {
+	struct scan_dir *sd = NULL;
 	int err;
 	mode_t mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
 
@@ -1612,13 +2792,23 @@ static int write_data(void)
 			return sys_err_msg("bad root file-system directory '%s'",
 					   root);
 	} else {
-		root_st.st_mtime = time(NULL);
+		if (reproducible)
+			root_st.st_mtime = clamp_time != -1 ? clamp_time : 0;
+		else
+			root_st.st_mtime = time(NULL);
 		root_st.st_atime = root_st.st_ctime = root_st.st_mtime;
 		root_st.st_mode = mode;
 	}
 
+	if (root) {
+		sd = scan_tree(root);
+		if (!sd)
+			return err_msg("out of memory");
+	}
+
 	head_flags = 0;
-	err = add_directory(root, UBIFS_ROOT_INO, &root_st, !root);
+	err = add_directory(root, sd, UBIFS_ROOT_INO, &root_st);
+	free_scan_dir(sd);
 	if (err)
 		return err;
 	err = add_multi_linked_files();
@@ -1639,16 +2829,77 @@ static int namecmp(const char *name1, const char *name2)
 	return (len1 < len2) ? -1 : 1;
 }
 
-static int cmp_idx(const void *a, const void *b)
+static int cmp_idx(const struct idx_sort_key *k1,
+		   const struct idx_sort_key *k2)
 {
-	const struct idx_entry *e1 = *(const struct idx_entry **)a;
-	const struct idx_entry *e2 = *(const struct idx_entry **)b;
-	int cmp;
+	if (k1->key != k2->key)
+		return k1->key < k2->key ? -1 : 1;
+	return namecmp(idx_entries[k1->n].name, idx_entries[k2->n].name);
+}
 
-	cmp = keys_cmp(&e1->key, &e2->key);
-	if (cmp)
-		return cmp;
-	return namecmp(e1->name, e2->name);
+/**
+ * idx_run_end - find the end of a sorted run of index sort keys.
+ * @keys: index sort keys
+ * @start: where the run starts
+ * @cnt: count of index sort keys
+ */
+static size_t idx_run_end(const struct idx_sort_key *keys, size_t start,
+			  size_t cnt)
+{
+	size_t i;
+
+	for (i = start + 1; i < cnt; i++)
+		if (cmp_idx(&keys[i - 1], &keys[i]) > 0)
+			break;
+	return i;
+}
+
+/**
+ * sort_idx - sort index sort keys.
+ * @keys: index sort keys to sort
+ * @tmp: temporary array of the same size
+ * @cnt: count of index sort keys
+ *
+ * Nodes are mostly added to the index in key order (e.g., all the data nodes
+ * of a file), so the index consists of long sorted runs. This function merges
+ * neighbouring runs until there is only one left, which takes much less work
+ * than sorting from scratch. Returns either @keys or @tmp, whichever contains
+ * the sorted keys.
+ */
+static struct idx_sort_key *sort_idx(struct idx_sort_key *keys,
+				     struct idx_sort_key *tmp, size_t cnt)
+{
+	struct idx_sort_key *src = keys, *dst = tmp, *t;
+	size_t i, j, k, mid, end, runs;
+
+	if (idx_run_end(src, 0, cnt) == cnt)
+		return src;
+
+	do {
+		runs = 0;
+		for (k = 0; k < cnt; k = end) {
+			mid = idx_run_end(src, k, cnt);
+			end = mid < cnt ? idx_run_end(src, mid, cnt) : cnt;
+			/* Merge runs [k, mid) and [mid, end) */
+			i = k;
+			j = mid;
+			while (i < mid && j < end) {
+				if (cmp_idx(&src[j], &src[i]) < 0)
+					dst[k++] = src[j++];
+				else
+					dst[k++] = src[i++];
+			}
+			memcpy(&dst[k], &src[i], (mid - i) * sizeof(*src));
+			k += mid - i;
+			memcpy(&dst[k], &src[j], (end - j) * sizeof(*src));
+			runs += 1;
+		}
+		t = src;
+		src = dst;
+		dst = t;
+	} while (runs > 1);
+
+	return src;
 }
 
 /**
@@ -1689,8 +2940,9 @@ static int add_idx_node(void *node, int child_cnt)
  */
 static int write_index(void)
 {
-	size_t sz, i, cnt, idx_sz, pstep, bcnt;
-	struct idx_entry **idx_ptr, **p;
+	size_t sz, i, k, n, cnt, idx_sz, pstep, bcnt;
+	struct idx_sort_key *keys, *tmp, *sorted;
+	struct idx_entry *p, e;
 	struct ubifs_idx_node *idx;
 	struct ubifs_branch *br;
 	int child_cnt = 0, j, level, blnum, boffs, blen, blast_len, err;
@@ -1704,27 +2956,56 @@ static int write_index(void)
 	idx = malloc(idx_sz);
 	if (!idx)
 		return err_msg("out of memory");
-	/* Make an array of pointers to sort the index list */
-	sz = idx_cnt * sizeof(struct idx_entry *);
-	if (sz / sizeof(struct idx_entry *) != idx_cnt) {
+	/* Make an array of sort keys to sort the index entries */
+	sz = idx_cnt * sizeof(struct idx_sort_key);
+	if (sz / sizeof(struct idx_sort_key) != idx_cnt) {
 		free(idx);
 		return err_msg("index is too big (%zu entries)", idx_cnt);
 	}
-	idx_ptr = malloc(sz);
-	if (!idx_ptr) {
+	/* No more index entries are added, give back the unused space */
+	p = realloc(idx_entries, idx_cnt * sizeof(struct idx_entry));
+	if (p) {
+		idx_entries = p;
+		idx_max = idx_cnt;
+	}
+	keys = malloc(sz);
+	tmp = malloc(sz);
+	if (!keys || !tmp) {
+		free(tmp);
+		free(keys);
 		free(idx);
 		return err_msg("out of memory - needed %zu bytes for index",
-			       sz);
+			       sz * 2);
+	}
+	for (i = 0; i < idx_cnt; i++) {
+		keys[i].key = (uint64_t)idx_entries[i].key.u32[0] << 32;
+		keys[i].key |= idx_entries[i].key.u32[1];
+		keys[i].n = i;
+	}
+	sorted = sort_idx(keys, tmp, idx_cnt);
+	free(sorted == keys ? tmp : keys);
+	/*
+	 * Put the index entries in order in place, following each cycle of the
+	 * permutation. Entries which are in place are marked in @sorted.
+	 */
+	for (i = 0; i < idx_cnt; i++) {
+		if (sorted[i].n == i)
+			continue;
+		e = idx_entries[i];
+		for (k = i; sorted[k].n != i; k = n) {
+			n = sorted[k].n;
+			idx_entries[k] = idx_entries[n];
+			sorted[k].n = k;
+		}
+		idx_entries[k] = e;
+		sorted[k].n = k;
 	}
-	idx_ptr[0] = idx_list_first;
-	for (i = 1; i < idx_cnt; i++)
-		idx_ptr[i] = idx_ptr[i - 1]->next;
-	qsort(idx_ptr, idx_cnt, sizeof(struct idx_entry *), cmp_idx);
+	free(sorted);
 	/* Write level 0 index nodes */
 	cnt = idx_cnt / c->fanout;
 	if (idx_cnt % c->fanout)
 		cnt += 1;
-	p = idx_ptr;
+	p = idx_entries;
 	blnum = head_lnum;
 	boffs = head_offs;
 	for (i = 0; i < cnt; i++) {
@@ -1744,10 +3025,10 @@ static int write_index(void)
 		idx->level = cpu_to_le16(0);
 		for (j = 0; j < child_cnt; j++, p++) {
 			br = ubifs_idx_branch(c, idx, j);
-			key_write_idx(&(*p)->key, &br->key);
-			br->lnum = cpu_to_le32((*p)->lnum);
-			br->offs = cpu_to_le32((*p)->offs);
-			br->len = cpu_to_le32((*p)->len);
+			key_write_idx(&p->key, &br->key);
+			br->lnum = cpu_to_le32(p->lnum);
+			br->offs = cpu_to_le32(p->offs);
+			br->len = cpu_to_le32(p->len);
 		}
 		add_idx_node(idx, child_cnt);
 	}
@@ -1772,7 +3053,7 @@ static int write_index(void)
 		 * child. Thus we can get the key by stepping along the bottom
 		 * level 'p' with an increasing large step 'pstep'.
 		 */
-		p = idx_ptr;
+		p = idx_entries;
 		pstep *= c->fanout;
 		for (i = 0; i < cnt; i++) {
 			/*
@@ -1816,7 +3097,7 @@ static int write_index(void)
 				 * of the index node from the level below.
 				 */
 				br = ubifs_idx_branch(c, idx, j);
-				key_write_idx(&(*p)->key, &br->key);
+				key_write_idx(&p->key, &br->key);
 				br->lnum = cpu_to_le32(blnum);
 				br->offs = cpu_to_le32(boffs);
 				br->len = cpu_to_le32(blen);
@@ -1832,9 +3113,8 @@ static int write_index(void)
 	}
 
 	/* Free stuff */
-	for (i = 0; i < idx_cnt; i++)
-		free(idx_ptr[i]);
-	free(idx_ptr);
+	free(idx_entries);
+	idx_entries = NULL;
 	free(idx);
 
 	dbg_msg(1, "zroot is at %d:%d len %d", c->zroot.lnum, c->zroot.offs,
@@ -1899,6 +3179,31 @@ static int finalize_leb_cnt(void)
 	return 0;
 }
 
+/**
+ * make_uuid - derive the UUID from the image contents.
+ * @uuid: UUID is returned here
+ *
+ * The UUID is the 128-bit hash of all nodes written so far, finalized like in
+ * MurmurHash3, with the version and variant bits set like for a random UUID.
+ */
+static void make_uuid(unsigned char *uuid)
+{
+	uint64_t h1 = image_hash[0], h2 = image_hash[1];
+
+	h1 += h2;
+	h2 += h1;
+	h1 = mix64(h1);
+	h2 = mix64(h2);
+	h1 += h2;
+	h2 += h1;
+	h1 = cpu_to_le64(h1);
+	h2 = cpu_to_le64(h2);
+	memcpy(uuid, &h1, 8);
+	memcpy(uuid + 8, &h2, 8);
+	uuid[6] = (uuid[6] & 0x0f) | 0x40;
+	uuid[8] = (uuid[8] & 0x3f) | 0x80;
+}
+
 /**
  * write_super - write the super block.
  */
@@ -1925,7 +3230,10 @@ static int write_super(void)
 	sup.default_compr = cpu_to_le16(c->default_compr);
 	sup.rp_size       = cpu_to_le64(c->rp_size);
 	sup.time_gran     = cpu_to_le32(DEFAULT_TIME_GRAN);
-	uuid_generate_random(sup.uuid);
+	if (reproducible)
+		make_uuid(sup.uuid);
+	else
+		uuid_generate_random(sup.uuid);
 	if (verbose) {
 		char s[40];
 
@@ -2106,6 +3414,8 @@ static int open_target(void)
 		if (out_fd == -1)
 			return sys_err_msg("cannot create output file '%s'",
 					   output);
+		if (start_out_thread())
+			return -1;
 	}
 	return 0;
 }
@@ -2121,13 +3431,16 @@ static int open_target(void)
  */
 static int close_target(void)
 {
+	int err;
+
+	err = stop_out_thread();
 	if (ubi)
 		libubi_close(ubi);
 	if (out_fd >= 0 && close(out_fd) == -1)
 		return sys_err_msg("cannot close the target '%s'", output);
 	if (output)
 		free(output);
-	return 0;
+	return err;
 }
 
 /**
@@ -2135,7 +3448,7 @@ static int close_target(void)
  */
 static int init(void)
 {
-	int err, i, main_lebs, big_lpt = 0, sz;
+	int err, i, main_lebs, big_lpt = 0;
 
 	c->highest_inum = UBIFS_FIRST_INO;
 
@@ -2182,37 +3495,51 @@ static int init(void)
 	if (!node_buf)
 		return err_msg("out of memory");
 
-	block_buf = malloc(UBIFS_BLOCK_SIZE);
-	if (!block_buf)
-		return err_msg("out of memory");
-
-	sz = sizeof(struct inum_mapping *) * HASH_TABLE_SIZE;
-	hash_table = malloc(sz);
+	hash_table_size = HASH_TABLE_SIZE;
+	hash_table = calloc(hash_table_size, sizeof(struct inum_mapping *));
 	if (!hash_table)
 		return err_msg("out of memory");
-	memset(hash_table, 0, sz);
 
-	err = init_compression();
+	compr_ctx = init_compr_ctx();
+	if (!compr_ctx)
+		return err_msg("cannot initialize compressors");
+
+	err = init_dedup_cache();
+	if (err)
+		return err;
+
+	err = start_compr_threads();
 	if (err)
 		return err;
 
+	if (base_image) {
+		err = base_open(base_image, base_manifest);
+		if (err)
+			return err;
+	}
+
+	if (manifest_file) {
+		err = manifest_open(manifest_file);
+		if (err)
+			return err;
+	}
+
 	return 0;
 }
 
 static void destroy_hash_table(void)
 {
-	int i;
-
-	for (i = 0; i < HASH_TABLE_SIZE; i++) {
-		struct inum_mapping *im, *q;
-
-		for (im = hash_table[i]; im; ) {
-			q = im;
-			im = im->next;
-			free(q->path_name);
-			free(q);
-		}
-	}
+	size_t i;
+
+	if (verbose && im_lookups)
+		printf("\tlink lookups: %llu (%llu probes, max %u)\n",
+		       im_lookups, im_probes, im_max_probes);
+	for (i = 0; i < im_cnt; i++)
+		free(inum_mapping(i)->path_name);
+	for (i = 0; i < im_cnt; i += INUM_MAPPINGS_CHUNK)
+		free(im_chunks[i / INUM_MAPPINGS_CHUNK]);
+	free(im_chunks);
+	free(hash_table);
 }
 
 /**
@@ -2224,9 +3551,12 @@ static void deinit(void)
 	free(c->ltab);
 	free(leb_buf);
 	free(node_buf);
-	free(block_buf);
+	stop_compr_threads();
+	free_dedup_cache();
+	base_close();
+	manifest_close();
 	destroy_hash_table();
-	free(hash_table);
+	destroy_compr_ctx(compr_ctx);
 	destroy_compression();
 	free_devtable_info();
 }
@@ -2252,6 +3582,10 @@ static int mkfs(void)
 	if (err)
 		goto out;
 
+	err = manifest_close();
+	if (err)
+		goto out;
+
 	err = set_gc_lnum();
 	if (err)
 		goto out;
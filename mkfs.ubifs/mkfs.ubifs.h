@@ -144,4 +144,19 @@ next_name_htbl_element(struct path_htbl_element *ph_elt,
 		       struct hashtable_itr **itr);
 void free_devtable_info(void);
 
+struct base_file;
+
+int manifest_open(const char *file);
+int manifest_add_file(const char *path, const struct stat *st);
+int manifest_add_block(unsigned int block_no, int len, uint32_t hash,
+		       int use_compr, int lnum, int offs, int node_len);
+int manifest_close(void);
+int base_open(const char *image, const char *file);
+struct base_file *base_find_file(const char *path, const struct stat *st);
+int base_get_block(struct base_file *bf, unsigned int block_no,
+		   const void *data, int len, uint32_t hash, int use_compr,
+		   void *out_buf,
+		   size_t *out_len, int *compr_type);
+void base_close(void);
+
 #endif
@@ -277,6 +277,9 @@ struct ubifs_znode
  * @default_compr: default compression type
  * @favor_lzo: favor LZO compression method
  * @favor_percent: lzo vs. zlib threshold used in case favor LZO
+ * @favor_precheck: skip LZO in case favor LZO for data which look
+ *                  incompressible
+ * @compr_level: compression level (effort), from 1 (fastest) to 9 (best)
  *
  * @key_hash_type: type of the key hash
  * @key_hash: direntry key hash function
@@ -355,6 +358,8 @@ struct ubifs_info
 	int default_compr;
 	int favor_lzo;
 	int favor_percent;
+	int favor_precheck;
+	int compr_level;
 
 	uint8_t key_hash_type;
 	uint32_t (*key_hash)(const char *str, int len);
@@ -1,7 +1,6 @@
 
 #define PROGRAM_NAME "recv_image"
-#define _XOPEN_SOURCE 500
-#define _BSD_SOURCE	/* struct ip_mreq */
+#define _GNU_SOURCE	/* struct ip_mreq, recvmmsg() */
 
 #include <errno.h>
 #include <error.h>
@@ -17,6 +16,7 @@
 #include <netinet/in.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include <crc32.h>
 #include "mtd/mtd-user.h"
 #include "mcast_image.h"
@@ -24,6 +24,19 @@
 #include "common.h"
 
 #define WBUF_SIZE 4096
+
+/* Maximum number of eraseblocks a decoder thread FEC-decodes together */
+#define DECODE_BATCH 8
+
+/* Maximum number of decoder threads */
+#define MAX_DECODERS 16
+
+/* Number of packets fetched from the socket with one recvmmsg() */
+#define RECV_BATCH 32
+
+/* Socket receive buffer we ask for, to ride out bursts at high rates */
+#define RECV_BUFFER (4 * 1024 * 1024)
+
 struct eraseblock {
 	uint32_t flash_offset;
 	unsigned char wbuf[WBUF_SIZE];
@@ -33,6 +46,436 @@ struct eraseblock {
 	uint32_t crc;
 };
 
+/*
+ * As soon as all the packets of an eraseblock have been received, the block
+ * goes through a pipeline while reception continues: the reader thread reads
+ * its packets back from flash, one of the decoder threads FEC-decodes and
+ * CRC-checks it, and the writer thread erases the block and writes the
+ * decoded data back. A block travels through the pipeline in a decode_job,
+ * taken from a fixed pool so that memory use does not depend on image size.
+ */
+struct decode_job {
+	int block_nr;
+	unsigned char *buf;	/* packets as read back from flash */
+	unsigned char **pkts;	/* packet pointers for fec_decode() */
+	unsigned char *data;	/* decoded eraseblock */
+	struct decode_job *next;
+};
+
+struct job_queue {
+	struct decode_job *head, *tail;
+	int closed;
+	pthread_cond_t cond;
+};
+
+static int flfd;
+static struct mtd_info_user meminfo;
+static int file_mode;
+static loff_t mtdoffset;
+static int nr_blocks;
+static int pkts_per_block;
+static int total_pkts_per_block;
+static struct eraseblock *eraseblocks;
+
+/* Protects everything below as well as mtdoffset */
+static pthread_mutex_t pipe_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Blocks which are completely received, in the order they completed */
+static int *ready_blocks;
+static int ready_cnt;
+static int receiving = 1;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+static struct job_queue free_jobs = { .cond = PTHREAD_COND_INITIALIZER };
+static struct job_queue read_jobs = { .cond = PTHREAD_COND_INITIALIZER };
+static struct job_queue decoded_jobs = { .cond = PTHREAD_COND_INITIALIZER };
+static int decoders_running;
+
+static pthread_t reader, writer, decoders[MAX_DECODERS];
+static int nr_decoders;
+
+/* In microseconds, as a block takes less than a millisecond in each stage */
+static unsigned long fec_time, flash_time, crc_time, rflash_time, erase_time;
+
+static unsigned long us_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+		now.tv_usec - start->tv_usec;
+}
+
+static void queue_put(struct job_queue *q, struct decode_job *job)
+{
+	pthread_mutex_lock(&pipe_mutex);
+	job->next = NULL;
+	if (q->tail)
+		q->tail->next = job;
+	else
+		q->head = job;
+	q->tail = job;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&pipe_mutex);
+}
+
+/* Take up to @max jobs off @q, waiting for one if it is empty. Returns the
+   number of jobs taken, which is 0 only once @q is closed and empty */
+static int queue_get(struct job_queue *q, struct decode_job **jobs, int max)
+{
+	int cnt = 0;
+
+	pthread_mutex_lock(&pipe_mutex);
+	while (!q->head && !q->closed)
+		pthread_cond_wait(&q->cond, &pipe_mutex);
+	while (q->head && cnt < max) {
+		jobs[cnt++] = q->head;
+		q->head = q->head->next;
+	}
+	if (!q->head)
+		q->tail = NULL;
+	pthread_mutex_unlock(&pipe_mutex);
+	return cnt;
+}
+
+static void queue_close(struct job_queue *q)
+{
+	pthread_mutex_lock(&pipe_mutex);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&pipe_mutex);
+}
+
+/* Hand a completely received block over to the reader thread */
+static void block_ready(int block_nr)
+{
+	pthread_mutex_lock(&pipe_mutex);
+	ready_blocks[ready_cnt++] = block_nr;
+	pthread_cond_signal(&ready_cond);
+	pthread_mutex_unlock(&pipe_mutex);
+}
+
+static void *reader_thread(void *arg)
+{
+	struct decode_job *job;
+	struct eraseblock *eb;
+	struct timeval start;
+	ssize_t rwlen;
+	int n, i;
+
+	for (n = 0; ; n++) {
+		pthread_mutex_lock(&pipe_mutex);
+		while (n == ready_cnt && receiving)
+			pthread_cond_wait(&ready_cond, &pipe_mutex);
+		if (n == ready_cnt) {
+			pthread_mutex_unlock(&pipe_mutex);
+			break;
+		}
+		eb = &eraseblocks[ready_blocks[n]];
+		pthread_mutex_unlock(&pipe_mutex);
+
+		if (!queue_get(&free_jobs, &job, 1))
+			break;
+		job->block_nr = ready_blocks[n];
+
+		gettimeofday(&start, NULL);
+		eb->flash_offset -= meminfo.erasesize;
+		rwlen = pread(flfd, job->buf, meminfo.erasesize, eb->flash_offset);
+		rflash_time += us_since(&start);
+		if (rwlen < 0) {
+			perror("read");
+			/* Argh. Perhaps we could go back and try again, but if the flash is
+			   going to fail to read back what we write to it, and the whole point
+			   in this program is to write to it, what's the point? */
+			fprintf(stderr, "Packets we wrote to flash seem to be unreadable. Aborting\n");
+			exit(1);
+		}
+
+		memcpy(job->buf + meminfo.erasesize, eb->wbuf, eb->wbuf_ofs);
+
+		for (i=0; i < pkts_per_block; i++)
+			job->pkts[i] = &job->buf[i * PKT_SIZE];
+		queue_put(&read_jobs, job);
+	}
+	queue_close(&read_jobs);
+	return arg;
+}
+
+static void *decoder_thread(void *arg)
+{
+	struct decode_job *jobs[DECODE_BATCH];
+	unsigned char **batch_pkts[DECODE_BATCH];
+	int *batch_indices[DECODE_BATCH];
+	struct fec_parms *fec;
+	struct timeval start;
+	unsigned long us;
+	uint32_t crc;
+	int cnt, i, j;
+
+	/* Each decoder has its own, so that they do not share a cache of
+	   decode matrices */
+	fec = fec_new(pkts_per_block, total_pkts_per_block);
+	if (!fec) {
+		fprintf(stderr, "Error initialising FEC\n");
+		exit(1);
+	}
+
+	/* Decode as many blocks as are waiting together, so that the ones
+	   which lost the same packets share a decode matrix */
+	while ((cnt = queue_get(&read_jobs, jobs, DECODE_BATCH))) {
+		for (j = 0; j < cnt; j++) {
+			batch_pkts[j] = jobs[j]->pkts;
+			batch_indices[j] = eraseblocks[jobs[j]->block_nr].pkt_indices;
+		}
+
+		gettimeofday(&start, NULL);
+		if (fec_decode_batch(fec, batch_pkts, batch_indices, cnt, PKT_SIZE)) {
+			/* Eep. This cannot happen */
+			printf("The world is broken. fec_decode() returned error\n");
+			exit(1);
+		}
+		us = us_since(&start);
+		pthread_mutex_lock(&pipe_mutex);
+		fec_time += us;
+		pthread_mutex_unlock(&pipe_mutex);
+
+		for (j = 0; j < cnt; j++) {
+			struct decode_job *job = jobs[j];
+			struct eraseblock *eb = &eraseblocks[job->block_nr];
+
+			for (i=0; i < pkts_per_block; i++)
+				memcpy(&job->data[i*PKT_SIZE], job->pkts[i], PKT_SIZE);
+
+			/* Paranoia */
+			gettimeofday(&start, NULL);
+			crc = mtd_crc32(-1, job->data, meminfo.erasesize);
+			if (crc != eb->crc) {
+				printf("\nCRC mismatch for block #%d: want %08x got %08x\n",
+				       job->block_nr, eb->crc, crc);
+				exit(1);
+			}
+			us = us_since(&start);
+			pthread_mutex_lock(&pipe_mutex);
+			crc_time += us;
+			pthread_mutex_unlock(&pipe_mutex);
+
+			queue_put(&decoded_jobs, job);
+		}
+	}
+	fec_free(fec);
+
+	pthread_mutex_lock(&pipe_mutex);
+	if (!--decoders_running) {
+		decoded_jobs.closed = 1;
+		pthread_cond_broadcast(&decoded_jobs.cond);
+	}
+	pthread_mutex_unlock(&pipe_mutex);
+	return arg;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct decode_job *job;
+	struct eraseblock *eb;
+	struct timeval start;
+	ssize_t rwlen;
+	int quiet;
+
+	while (queue_get(&decoded_jobs, &job, 1)) {
+		eb = &eraseblocks[job->block_nr];
+
+		/* Don't mess up the reception progress line */
+		pthread_mutex_lock(&pipe_mutex);
+		quiet = receiving;
+		pthread_mutex_unlock(&pipe_mutex);
+
+		gettimeofday(&start, NULL);
+		if (!file_mode) {
+			struct erase_info_user erase;
+
+			erase.start = eb->flash_offset;
+			erase.length = meminfo.erasesize;
+
+			if (!quiet)
+				printf("\rErasing block at %08x...", erase.start);
+
+			if (ioctl(flfd, MEMERASE, &erase)) {
+				perror("MEMERASE");
+				/* This block has dirty data on it. If the erase failed, we're screwed */
+				fprintf(stderr, "Erase to clean FEC data from flash failed. Aborting\n");
+				exit(1);
+			}
+			erase_time += us_since(&start);
+			gettimeofday(&start, NULL);
+		}
+		else if (!quiet)
+			printf("\r");
+	write_again:
+		rwlen = pwrite(flfd, job->data, meminfo.erasesize, eb->flash_offset);
+		if (rwlen < meminfo.erasesize) {
+			if (rwlen < 0) {
+				perror("\ndecoded data write");
+			} else
+				fprintf(stderr, "\nshort write of decoded data\n");
+
+			if (!file_mode) {
+				struct erase_info_user erase;
+				erase.start = eb->flash_offset;
+				erase.length = meminfo.erasesize;
+
+				printf("Erasing failed block at %08x\n",
+				       eb->flash_offset);
+
+				if (ioctl(flfd, MEMERASE, &erase)) {
+					perror("MEMERASE");
+					exit(1);
+				}
+				pthread_mutex_lock(&pipe_mutex);
+				if (mtdoffset >= meminfo.size) {
+					fprintf(stderr, "Run out of space on flash\n");
+					exit(1);
+				}
+				while (ioctl(flfd, MEMGETBADBLOCK, &mtdoffset) > 0) {
+					printf("Skipping flash bad block at %08x\n", (uint32_t)mtdoffset);
+					mtdoffset += meminfo.erasesize;
+					if (mtdoffset >= meminfo.size) {
+						fprintf(stderr, "Run out of space on flash\n");
+						exit(1);
+					}
+				}
+				printf("Will try again at %08lx...", (long)mtdoffset);
+				eb->flash_offset = mtdoffset;
+				/* Nothing else may be put here */
+				mtdoffset += meminfo.erasesize;
+				pthread_mutex_unlock(&pipe_mutex);
+
+				goto write_again;
+			}
+			else /* Usually nothing we can do in file mode */
+				exit(1);
+		}
+		flash_time += us_since(&start);
+
+		if (!quiet) {
+			printf("wrote image block %08x (%d pkts)    ",
+			       job->block_nr * meminfo.erasesize, eb->nr_pkts);
+			fflush(stdout);
+		}
+		queue_put(&free_jobs, job);
+	}
+	return arg;
+}
+
+/* Start the pipeline threads once the image geometry is known */
+static void start_pipeline(void)
+{
+	struct decode_job *job;
+	long cpus;
+	int i;
+
+	ready_blocks = malloc(nr_blocks * sizeof(int));
+	if (!ready_blocks) {
+		fprintf(stderr, "No memory for block queue\n");
+		exit(1);
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_decoders = cpus < 1 ? 1 : cpus > MAX_DECODERS ? MAX_DECODERS : cpus;
+
+	/* Enough for every decoder to work on one block while the next one
+	   is being read back, plus one for the writer */
+	for (i = 0; i < 2 * nr_decoders + 1; i++) {
+		job = malloc(sizeof(*job));
+		if (job) {
+			job->buf = malloc(pkts_per_block * PKT_SIZE);
+			job->data = malloc(pkts_per_block * PKT_SIZE);
+			job->pkts = malloc(sizeof(unsigned char *) * pkts_per_block);
+		}
+		if (!job || !job->buf || !job->data || !job->pkts) {
+			fprintf(stderr, "No memory for eraseblock buffer\n");
+			exit(1);
+		}
+		queue_put(&free_jobs, job);
+	}
+
+	decoders_running = nr_decoders;
+	if (pthread_create(&reader, NULL, reader_thread, NULL) ||
+	    pthread_create(&writer, NULL, writer_thread, NULL)) {
+		fprintf(stderr, "Failed to start pipeline threads\n");
+		exit(1);
+	}
+	for (i = 0; i < nr_decoders; i++) {
+		if (pthread_create(&decoders[i], NULL, decoder_thread, NULL)) {
+			fprintf(stderr, "Failed to start decoder threads\n");
+			exit(1);
+		}
+	}
+}
+
+/* Wait for the pipeline to process all the blocks which are still in it */
+static void finish_pipeline(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pipe_mutex);
+	receiving = 0;
+	pthread_cond_signal(&ready_cond);
+	pthread_mutex_unlock(&pipe_mutex);
+
+	pthread_join(reader, NULL);
+	for (i = 0; i < nr_decoders; i++)
+		pthread_join(decoders[i], NULL);
+	pthread_join(writer, NULL);
+}
+
+/*
+ * Return the next packet from the socket, and its length in @len (negative
+ * on error). Packets are read RECV_BATCH at a time with recvmmsg() if the
+ * kernel has it, and the returned one stays valid until the next call.
+ */
+static struct image_pkt *next_pkt(int sock, ssize_t *len)
+{
+	static struct image_pkt pkts[RECV_BATCH];
+	static struct mmsghdr msgs[RECV_BATCH];
+	static struct iovec iovs[RECV_BATCH];
+	static int cnt, next, no_recvmmsg;
+	int i, ret;
+
+	if (next < cnt) {
+		*len = msgs[next].msg_len;
+		return &pkts[next++];
+	}
+
+	if (!msgs[0].msg_hdr.msg_iov) {
+		for (i = 0; i < RECV_BATCH; i++) {
+			iovs[i].iov_base = &pkts[i];
+			iovs[i].iov_len = sizeof(pkts[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+	}
+
+	cnt = next = 0;
+	while (!no_recvmmsg) {
+		/* Wait for one packet, then take whatever else is queued */
+		ret = recvmmsg(sock, msgs, RECV_BATCH, MSG_WAITFORONE, NULL);
+		if (ret > 0) {
+			cnt = ret;
+			next = 1;
+			*len = msgs[0].msg_len;
+			return &pkts[0];
+		}
+		if (ret < 0 && errno != ENOSYS) {
+			*len = -1;
+			return NULL;
+		}
+		if (ret < 0)
+			no_recvmmsg = 1;
+	}
+	*len = read(sock, &pkts[0], sizeof(pkts[0]));
+	return &pkts[0];
+}
+
 int main(int argc, char **argv)
 {
 	struct addrinfo *ai;
@@ -41,26 +484,17 @@ int main(int argc, char **argv)
 	int ret;
 	int sock;
 	ssize_t len;
-	int flfd;
-	struct mtd_info_user meminfo;
-	unsigned char *eb_buf, *decode_buf, **src_pkts;
-	int nr_blocks = 0;
-	int pkts_per_block;
 	int block_nr = -1;
 	uint32_t image_crc = 0;
 	int total_pkts = 0;
 	int ignored_pkts = 0;
-	loff_t mtdoffset = 0;
 	int badcrcs = 0;
 	int duplicates = 0;
-	int file_mode = 0;
 	struct fec_parms *fec = NULL;
 	int i;
-	struct eraseblock *eraseblocks = NULL;
 	uint32_t start_seq = 0;
 	struct timeval start, now;
-	unsigned long fec_time = 0, flash_time = 0, crc_time = 0,
-		rflash_time = 0, erase_time = 0, net_time = 0;
+	unsigned long net_time = 0, tail_time;
 
 	if (argc != 4) {
 		fprintf(stderr, "usage: %s <host> <port> <mtddev>\n",
@@ -96,18 +530,6 @@ int main(int argc, char **argv)
 
 	pkts_per_block = (meminfo.erasesize + PKT_SIZE - 1) / PKT_SIZE;
 
-	eb_buf = malloc(pkts_per_block * PKT_SIZE);
-	decode_buf = malloc(pkts_per_block * PKT_SIZE);
-	if (!eb_buf && !decode_buf) {
-		fprintf(stderr, "No memory for eraseblock buffer\n");
-		exit(1);
-	}
-	src_pkts = malloc(sizeof(unsigned char *) * pkts_per_block);
-	if (!src_pkts) {
-		fprintf(stderr, "No memory for decode packet pointers\n");
-		exit(1);
-	}
-
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_flags = AI_ADDRCONFIG;
 	hints.ai_socktype = SOCK_DGRAM;
@@ -157,32 +579,43 @@ int main(int argc, char **argv)
 	if (!runp)
 		exit(1);
 
+	/* Best effort, the kernel caps it at net.core.rmem_max */
+	i = RECV_BUFFER;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &i, sizeof(i));
+
 	while (1) {
-		struct image_pkt thispkt;
+		struct image_pkt *thispkt;
 
-		len = read(sock, &thispkt, sizeof(thispkt));
+		thispkt = next_pkt(sock, &len);
 
 		if (len < 0) {
 			perror("read socket");
 			break;
 		}
-		if (len < sizeof(thispkt)) {
+		if (len < sizeof(*thispkt)) {
 			fprintf(stderr, "Wrong length %zd bytes (expected %zu)\n",
-				len, sizeof(thispkt));
+				len, sizeof(*thispkt));
 			continue;
 		}
 		if (!eraseblocks) {
-			image_crc = thispkt.hdr.totcrc;
-			start_seq = ntohl(thispkt.hdr.pkt_sequence);
+			image_crc = thispkt->hdr.totcrc;
+			start_seq = ntohl(thispkt->hdr.pkt_sequence);
 
-			if (meminfo.erasesize != ntohl(thispkt.hdr.blocksize)) {
+			if (meminfo.erasesize != ntohl(thispkt->hdr.blocksize)) {
 				fprintf(stderr, "Erasesize mismatch (0x%x not 0x%x)\n",
-					ntohl(thispkt.hdr.blocksize), meminfo.erasesize);
+					ntohl(thispkt->hdr.blocksize), meminfo.erasesize);
+				exit(1);
+			}
+			nr_blocks = ntohl(thispkt->hdr.nr_blocks);
+
+			total_pkts_per_block = ntohs(thispkt->hdr.nr_pkts);
+			/* The decoder threads have their own, but this checks the
+			   parameters and sets up libfec before they start */
+			fec = fec_new(pkts_per_block, total_pkts_per_block);
+			if (!fec) {
+				fprintf(stderr, "Error initialising FEC\n");
 				exit(1);
 			}
-			nr_blocks = ntohl(thispkt.hdr.nr_blocks);
-
-			fec = fec_new(pkts_per_block, ntohs(thispkt.hdr.nr_pkts));
 
 			eraseblocks = malloc(nr_blocks * sizeof(*eraseblocks));
 			if (!eraseblocks) {
@@ -212,22 +645,23 @@ int main(int argc, char **argv)
 				mtdoffset += meminfo.erasesize;
 				eraseblocks[i].wbuf_ofs = 0;
 			}
+			start_pipeline();
 			gettimeofday(&start, NULL);
 		}
-		if (image_crc != thispkt.hdr.totcrc) {
+		if (image_crc != thispkt->hdr.totcrc) {
 			fprintf(stderr, "\nImage CRC changed from 0x%x to 0x%x. Aborting\n",
-				ntohl(image_crc), ntohl(thispkt.hdr.totcrc));
+				ntohl(image_crc), ntohl(thispkt->hdr.totcrc));
 			exit(1);
 		}
 
-		block_nr = ntohl(thispkt.hdr.block_nr);
+		block_nr = ntohl(thispkt->hdr.block_nr);
 		if (block_nr >= nr_blocks) {
 			fprintf(stderr, "\nErroneous block_nr %d (> %d)\n",
 				block_nr, nr_blocks);
 			exit(1);
 		}
 		for (i=0; i<eraseblocks[block_nr].nr_pkts; i++) {
-			if (eraseblocks[block_nr].pkt_indices[i] == ntohs(thispkt.hdr.pkt_nr)) {
+			if (eraseblocks[block_nr].pkt_indices[i] == ntohs(thispkt->hdr.pkt_nr)) {
 //				printf("Discarding duplicate packet at %08x pkt %d\n",
 //				       block_nr * meminfo.erasesize, eraseblocks[block_nr].pkt_indices[i]);
 				duplicates++;
@@ -245,25 +679,28 @@ int main(int argc, char **argv)
 			continue;
 		}
 
-		if (mtd_crc32(-1, thispkt.data, PKT_SIZE) != ntohl(thispkt.hdr.thiscrc)) {
+		if (mtd_crc32(-1, thispkt->data, PKT_SIZE) != ntohl(thispkt->hdr.thiscrc)) {
 			printf("\nDiscard %08x pkt %d with bad CRC (%08x not %08x)\n",
-			       block_nr * meminfo.erasesize, ntohs(thispkt.hdr.pkt_nr),
-			       mtd_crc32(-1, thispkt.data, PKT_SIZE),
-			       ntohl(thispkt.hdr.thiscrc));
+			       block_nr * meminfo.erasesize, ntohs(thispkt->hdr.pkt_nr),
+			       mtd_crc32(-1, thispkt->data, PKT_SIZE),
+			       ntohl(thispkt->hdr.thiscrc));
 			badcrcs++;
 			continue;
 		}
 	pkt_again:
 		eraseblocks[block_nr].pkt_indices[eraseblocks[block_nr].nr_pkts++] =
-			ntohs(thispkt.hdr.pkt_nr);
+			ntohs(thispkt->hdr.pkt_nr);
 		total_pkts++;
 		if (!(total_pkts % 50) || total_pkts == pkts_per_block * nr_blocks) {
-			uint32_t pkts_sent = ntohl(thispkt.hdr.pkt_sequence) - start_seq + 1;
+			uint32_t pkts_sent = ntohl(thispkt->hdr.pkt_sequence) - start_seq + 1;
 			long time_msec;
 			gettimeofday(&now, NULL);
 
 			time_msec = ((now.tv_usec - start.tv_usec) / 1000) +
 				(now.tv_sec - start.tv_sec) * 1000;
+			/* At high rates the first packets arrive within 1ms */
+			if (!time_msec)
+				time_msec = 1;
 
 			printf("\rReceived %d/%d (%d%%) in %lds @%ldKiB/s, %d lost (%d%%), %d dup/xs    ",
 			       total_pkts, nr_blocks * pkts_per_block,
@@ -279,7 +716,7 @@ int main(int argc, char **argv)
 		if (eraseblocks[block_nr].wbuf_ofs + PKT_SIZE < WBUF_SIZE) {
 			/* New packet doesn't full the wbuf */
 			memcpy(eraseblocks[block_nr].wbuf + eraseblocks[block_nr].wbuf_ofs,
-			       thispkt.data, PKT_SIZE);
+			       thispkt->data, PKT_SIZE);
 			eraseblocks[block_nr].wbuf_ofs += PKT_SIZE;
 		} else {
 			int fits = WBUF_SIZE - eraseblocks[block_nr].wbuf_ofs;
@@ -287,7 +724,7 @@ int main(int argc, char **argv)
 			static int faked = 1;
 
 			memcpy(eraseblocks[block_nr].wbuf + eraseblocks[block_nr].wbuf_ofs,
-			       thispkt.data, fits);
+			       thispkt->data, fits);
 			wrotelen = pwrite(flfd, eraseblocks[block_nr].wbuf, WBUF_SIZE,
 					  eraseblocks[block_nr].flash_offset);
 
@@ -314,6 +751,8 @@ int main(int argc, char **argv)
 						perror("MEMERASE");
 						exit(1);
 					}
+					/* The writer thread may be relocating a block too */
+					pthread_mutex_lock(&pipe_mutex);
 					if (mtdoffset >= meminfo.size) {
 						fprintf(stderr, "Run out of space on flash\n");
 						exit(1);
@@ -332,6 +771,7 @@ int main(int argc, char **argv)
 					eraseblocks[block_nr].nr_pkts = 0;
 					eraseblocks[block_nr].wbuf_ofs = 0;
 					mtdoffset += meminfo.erasesize;
+					pthread_mutex_unlock(&pipe_mutex);
 					goto pkt_again;
 				}
 				else /* Usually nothing we can do in file mode */
@@ -339,12 +779,13 @@ int main(int argc, char **argv)
 			}
 			eraseblocks[block_nr].flash_offset += WBUF_SIZE;
 			/* Copy the remainder into the wbuf */
-			memcpy(eraseblocks[block_nr].wbuf, &thispkt.data[fits], PKT_SIZE - fits);
+			memcpy(eraseblocks[block_nr].wbuf, &thispkt->data[fits], PKT_SIZE - fits);
 			eraseblocks[block_nr].wbuf_ofs = PKT_SIZE - fits;
 		}
 
 		if (eraseblocks[block_nr].nr_pkts == pkts_per_block) {
-			eraseblocks[block_nr].crc = ntohl(thispkt.hdr.block_crc);
+			eraseblocks[block_nr].crc = ntohl(thispkt->hdr.block_crc);
+			block_ready(block_nr);
 
 			if (total_pkts == nr_blocks * pkts_per_block)
 				break;
@@ -355,131 +796,31 @@ int main(int argc, char **argv)
 	net_time = (now.tv_usec - start.tv_usec) / 1000;
 	net_time += (now.tv_sec - start.tv_sec) * 1000;
 	close(sock);
-	for (block_nr = 0; block_nr < nr_blocks; block_nr++) {
-		ssize_t rwlen;
-		gettimeofday(&start, NULL);
-		eraseblocks[block_nr].flash_offset -= meminfo.erasesize;
-		rwlen = pread(flfd, eb_buf, meminfo.erasesize, eraseblocks[block_nr].flash_offset);
-
-		gettimeofday(&now, NULL);
-		rflash_time += (now.tv_usec - start.tv_usec) / 1000;
-		rflash_time += (now.tv_sec - start.tv_sec) * 1000;
-		if (rwlen < 0) {
-			perror("read");
-			/* Argh. Perhaps we could go back and try again, but if the flash is
-			   going to fail to read back what we write to it, and the whole point
-			   in this program is to write to it, what's the point? */
-			fprintf(stderr, "Packets we wrote to flash seem to be unreadable. Aborting\n");
-			exit(1);
-		}
 
-		memcpy(eb_buf + meminfo.erasesize, eraseblocks[block_nr].wbuf,
-		       eraseblocks[block_nr].wbuf_ofs);
-
-		for (i=0; i < pkts_per_block; i++)
-			src_pkts[i] = &eb_buf[i * PKT_SIZE];
-
-		gettimeofday(&start, NULL);
-		if (fec_decode(fec, src_pkts, eraseblocks[block_nr].pkt_indices, PKT_SIZE)) {
-			/* Eep. This cannot happen */
-			printf("The world is broken. fec_decode() returned error\n");
-			exit(1);
-		}
-		gettimeofday(&now, NULL);
-		fec_time += (now.tv_usec - start.tv_usec) / 1000;
-		fec_time += (now.tv_sec - start.tv_sec) * 1000;
-
-		for (i=0; i < pkts_per_block; i++)
-			memcpy(&decode_buf[i*PKT_SIZE], src_pkts[i], PKT_SIZE);
-
-		/* Paranoia */
-		gettimeofday(&start, NULL);
-		if (mtd_crc32(-1, decode_buf, meminfo.erasesize) != eraseblocks[block_nr].crc) {
-			printf("\nCRC mismatch for block #%d: want %08x got %08x\n",
-			       block_nr, eraseblocks[block_nr].crc,
-			       mtd_crc32(-1, decode_buf, meminfo.erasesize));
-			exit(1);
-		}
-		gettimeofday(&now, NULL);
-		crc_time += (now.tv_usec - start.tv_usec) / 1000;
-		crc_time += (now.tv_sec - start.tv_sec) * 1000;
-		start = now;
-
-		if (!file_mode) {
-			struct erase_info_user erase;
-
-			erase.start = eraseblocks[block_nr].flash_offset;
-			erase.length = meminfo.erasesize;
-
-			printf("\rErasing block at %08x...", erase.start);
-
-			if (ioctl(flfd, MEMERASE, &erase)) {
-				perror("MEMERASE");
-				/* This block has dirty data on it. If the erase failed, we're screwed */
-				fprintf(stderr, "Erase to clean FEC data from flash failed. Aborting\n");
-				exit(1);
-			}
-			gettimeofday(&now, NULL);
-			erase_time += (now.tv_usec - start.tv_usec) / 1000;
-			erase_time += (now.tv_sec - start.tv_sec) * 1000;
-			start = now;
-		}
-		else printf("\r");
-	write_again:
-		rwlen = pwrite(flfd, decode_buf, meminfo.erasesize, eraseblocks[block_nr].flash_offset);
-		if (rwlen < meminfo.erasesize) {
-			if (rwlen < 0) {
-				perror("\ndecoded data write");
-			} else
-				fprintf(stderr, "\nshort write of decoded data\n");
-
-			if (!file_mode) {
-				struct erase_info_user erase;
-				erase.start = eraseblocks[block_nr].flash_offset;
-				erase.length = meminfo.erasesize;
-
-				printf("Erasing failed block at %08x\n",
-				       eraseblocks[block_nr].flash_offset);
-
-				if (ioctl(flfd, MEMERASE, &erase)) {
-					perror("MEMERASE");
-					exit(1);
-				}
-				if (mtdoffset >= meminfo.size) {
-					fprintf(stderr, "Run out of space on flash\n");
-					exit(1);
-				}
-				while (ioctl(flfd, MEMGETBADBLOCK, &mtdoffset) > 0) {
-					printf("Skipping flash bad block at %08x\n", (uint32_t)mtdoffset);
-					mtdoffset += meminfo.erasesize;
-					if (mtdoffset >= meminfo.size) {
-						fprintf(stderr, "Run out of space on flash\n");
-						exit(1);
-					}
-				}
-				printf("Will try again at %08lx...", (long)mtdoffset);
-				eraseblocks[block_nr].flash_offset = mtdoffset;
-
-				goto write_again;
-			}
-			else /* Usually nothing we can do in file mode */
-				exit(1);
-		}
-		gettimeofday(&now, NULL);
-		flash_time += (now.tv_usec - start.tv_usec) / 1000;
-		flash_time += (now.tv_sec - start.tv_sec) * 1000;
+	/* Blocks which did not get all their packets are not going to decode,
+	   but let the pipeline find out just the same */
+	for (block_nr = 0; block_nr < nr_blocks; block_nr++)
+		if (eraseblocks[block_nr].nr_pkts < pkts_per_block)
+			block_ready(block_nr);
+	if (eraseblocks)
+		finish_pipeline();
+	tail_time = us_since(&now) / 1000;
+	printf("\n");
 
-		printf("wrote image block %08x (%d pkts)    ",
-		       block_nr * meminfo.erasesize, eraseblocks[block_nr].nr_pkts);
-		fflush(stdout);
-	}
 	close(flfd);
 	printf("Net rx   %ld.%03lds\n", net_time / 1000, net_time % 1000);
-	printf("flash rd %ld.%03lds\n", rflash_time / 1000, rflash_time % 1000);
-	printf("FEC time %ld.%03lds\n", fec_time / 1000, fec_time % 1000);
-	printf("CRC time %ld.%03lds\n", crc_time / 1000, crc_time % 1000);
-	printf("flash wr %ld.%03lds\n", flash_time / 1000, flash_time % 1000);
-	printf("flash er %ld.%03lds\n", erase_time / 1000, erase_time % 1000);
+	printf("flash rd %ld.%03lds\n", rflash_time / 1000000,
+	       rflash_time / 1000 % 1000);
+	printf("FEC time %ld.%03lds\n", fec_time / 1000000,
+	       fec_time / 1000 % 1000);
+	printf("CRC time %ld.%03lds\n", crc_time / 1000000,
+	       crc_time / 1000 % 1000);
+	printf("flash wr %ld.%03lds\n", flash_time / 1000000,
+	       flash_time / 1000 % 1000);
+	printf("flash er %ld.%03lds\n", erase_time / 1000000,
+	       erase_time / 1000 % 1000);
+	printf("Post rx  %ld.%03lds (%d decoder threads)\n", tail_time / 1000,
+	       tail_time % 1000, nr_decoders);
 
 	return 0;
 }
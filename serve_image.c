@@ -1,5 +1,5 @@
 #define PROGRAM_NAME "serve_image"
-#define _POSIX_C_SOURCE 199309
+#define _GNU_SOURCE	/* sendmmsg() */
 
 #include <time.h>
 #include <errno.h>
@@ -22,10 +22,94 @@
 #include "mcast_image.h"
 
 int tx_rate = 80000;
-int pkt_delay;
+
+/* Highest transmit rate accepted, in KiB/s (about 16Gbit/s) */
+#define MAX_TX_RATE 2000000
+
+/* Number of packets handed to the kernel with one sendmmsg() */
+#define SEND_BATCH 32
 
 #undef RANDOMDROP
 
+/*
+ * The transmit rate is kept with a token bucket: tokens, in bytes, build up
+ * at tx_rate per second up to a burst of a few batches, and sending a batch
+ * spends them. If there are not enough, we sleep until there are. Timer
+ * slack and the time spent encoding only shift the next batch rather than
+ * lowering the rate.
+ */
+static long long tokens = SEND_BATCH * sizeof(struct image_pkt);
+static struct timespec last_refill;
+
+static void refill_tokens(void)
+{
+	const long long burst = 4 * SEND_BATCH * sizeof(struct image_pkt);
+	struct timespec now;
+	long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - last_refill.tv_sec) * 1000000000LL +
+		now.tv_nsec - last_refill.tv_nsec;
+	last_refill = now;
+	if (ns > 1000000000)
+		ns = 1000000000;
+	tokens += ns * tx_rate / 1000000000;
+	if (tokens > burst)
+		tokens = burst;
+}
+
+static void pace(long long bytes)
+{
+	struct timespec req;
+	long long ns;
+
+	refill_tokens();
+	if (tokens < bytes) {
+		ns = (bytes - tokens) * 1000000000 / tx_rate;
+		req.tv_sec = ns / 1000000000;
+		req.tv_nsec = ns % 1000000000;
+		nanosleep(&req, NULL);
+		refill_tokens();
+	}
+	/* Going into debt if we overslept a little is fine */
+	tokens -= bytes;
+}
+
+/*
+ * Send @cnt packets, all with sendmmsg() if the kernel has it. A packet the
+ * kernel refuses is reported and dropped, like a lost one.
+ */
+static void send_pkts(int sock, struct mmsghdr *msgs, int cnt)
+{
+	static int no_sendmmsg;
+	static int writeerrors;
+	int i, ret;
+
+	for (i = 0; i < cnt; ) {
+		if (no_sendmmsg)
+			ret = write(sock, msgs[i].msg_hdr.msg_iov->iov_base,
+				    msgs[i].msg_hdr.msg_iov->iov_len) < 0 ? -1 : 1;
+		else
+			ret = sendmmsg(sock, &msgs[i], cnt - i, 0);
+		if (ret < 0 && errno == ENOSYS && !no_sendmmsg) {
+			no_sendmmsg = 1;
+			continue;
+		}
+		if (ret < 0) {
+			perror("write");
+			writeerrors++;
+			if (writeerrors > 10) {
+				fprintf(stderr, "Too many consecutive write errors\n");
+				exit(1);
+			}
+			i++;
+			continue;
+		}
+		writeerrors = 0;
+		i += ret;
+	}
+}
+
 int main(int argc, char **argv)
 {
 	struct addrinfo *ai;
@@ -34,29 +118,34 @@ int main(int argc, char **argv)
 	int ret;
 	int sock;
 	struct image_pkt pktbuf;
+	static struct image_pkt pkts[SEND_BATCH];
+	struct mmsghdr msgs[SEND_BATCH];
+	struct iovec iovs[SEND_BATCH];
+	int nr_queued = 0;
 	int rfd;
 	struct stat st;
-	int writeerrors = 0;
 	uint32_t erasesize;
 	unsigned char *image, *blockptr = NULL;
 	uint32_t block_nr, pkt_nr;
 	int nr_blocks;
-	struct timeval then, now, nextpkt;
+	struct timeval then, now;
 	long time_msecs;
 	int pkts_per_block;
 	int total_pkts_per_block;
 	struct fec_parms *fec;
 	unsigned char *last_block;
 	uint32_t *block_crcs;
-	long tosleep;
 	uint32_t sequence = 0;
+	int i;
 
 	if (argc == 6) {
-		tx_rate = atol(argv[5]) * 1024;
-		if (tx_rate < PKT_SIZE || tx_rate > 20000000) {
-			fprintf(stderr, "Bogus TX rate %d KiB/s\n", tx_rate);
+		long rate = atol(argv[5]);
+
+		if (rate * 1024 < PKT_SIZE || rate > MAX_TX_RATE) {
+			fprintf(stderr, "Bogus TX rate %ld KiB/s\n", rate);
 			exit(1);
 		}
+		tx_rate = rate * 1024;
 		argc = 5;
 	}
 	if (argc != 5) {
@@ -64,8 +153,6 @@ int main(int argc, char **argv)
 			PROGRAM_NAME);
 		exit(1);
 	}
-	pkt_delay = (sizeof(pktbuf) * 1000000) / tx_rate;
-	printf("Inter-packet delay (avg): %dµs\n", pkt_delay);
 	printf("Transmit rate: %d KiB/s\n", tx_rate / 1024);
 
 	erasesize = atol(argv[4]);
@@ -172,9 +259,18 @@ int main(int argc, char **argv)
 	       "Estimated transmit time per cycle: %ds\n",
 	       (long)st.st_size / 1024, (long) st.st_size,
 	       nr_blocks, pkts_per_block,
-	       nr_blocks * pkts_per_block * pkt_delay / 1000000);
+	       (int)((long long)nr_blocks * pkts_per_block * sizeof(pktbuf) / tx_rate));
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < SEND_BATCH; i++) {
+		iovs[i].iov_base = &pkts[i];
+		iovs[i].iov_len = sizeof(pkts[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
 	gettimeofday(&then, NULL);
-	nextpkt = then;
+	clock_gettime(CLOCK_MONOTONIC, &last_refill);
 
 #ifdef RANDOMDROP
 	srand((unsigned)then.tv_usec);
@@ -196,6 +292,7 @@ int main(int argc, char **argv)
 
 		for (block_nr = 0; block_nr < nr_blocks; block_nr++) {
 
+			struct image_pkt *pkt = &pkts[nr_queued];
 			int actualpkt;
 
 			/* Calculating the redundant FEC blocks is expensive;
@@ -213,17 +310,20 @@ int main(int argc, char **argv)
 			if (block_nr == nr_blocks - 1)
 				blockptr = last_block;
 
-			fec_encode_linear(fec, blockptr, pktbuf.data, actualpkt, PKT_SIZE);
+			fec_encode_linear(fec, blockptr, pkt->data, actualpkt, PKT_SIZE);
 
-			pktbuf.hdr.thiscrc = htonl(mtd_crc32(-1, pktbuf.data, PKT_SIZE));
-			pktbuf.hdr.block_crc = htonl(block_crcs[block_nr]);
-			pktbuf.hdr.block_nr = htonl(block_nr);
-			pktbuf.hdr.pkt_nr = htons(actualpkt);
-			pktbuf.hdr.pkt_sequence = htonl(sequence++);
+			pkt->hdr = pktbuf.hdr;
+			pkt->hdr.thiscrc = htonl(mtd_crc32(-1, pkt->data, PKT_SIZE));
+			pkt->hdr.block_crc = htonl(block_crcs[block_nr]);
+			pkt->hdr.block_nr = htonl(block_nr);
+			pkt->hdr.pkt_nr = htons(actualpkt);
+			pkt->hdr.pkt_sequence = htonl(sequence++);
 
-			printf("\rSending data block %08x packet %3d/%d",
-			       block_nr * erasesize,
-			       pkt_nr, total_pkts_per_block);
+			/* Once per batch is plenty at high rates */
+			if (!nr_queued)
+				printf("\rSending data block %08x packet %3d/%d",
+				       block_nr * erasesize,
+				       pkt_nr, total_pkts_per_block);
 
 			if (pkt_nr && !block_nr) {
 				unsigned long amt_sent = pkt_nr * nr_blocks * sizeof(pktbuf);
@@ -244,54 +344,12 @@ int main(int argc, char **argv)
 				continue;
 			}
 #endif
-			gettimeofday(&now, NULL);
-#if 1
-			tosleep = nextpkt.tv_usec - now.tv_usec +
-				(1000000 * (nextpkt.tv_sec - now.tv_sec));
-
-			/* We need hrtimers for this to actually work */
-			if (tosleep > 0) {
-				struct timespec req;
-
-				req.tv_nsec = (tosleep % 1000000) * 1000;
-				req.tv_sec = tosleep / 1000000;
-
-				nanosleep(&req, NULL);
-			}
-#else
-			while (now.tv_sec < nextpkt.tv_sec ||
-				 (now.tv_sec == nextpkt.tv_sec &&
-				  now.tv_usec < nextpkt.tv_usec)) {
-				gettimeofday(&now, NULL);
-			}
-#endif
-			nextpkt.tv_usec += pkt_delay;
-			if (nextpkt.tv_usec >= 1000000) {
-				nextpkt.tv_sec += nextpkt.tv_usec / 1000000;
-				nextpkt.tv_usec %= 1000000;
-			}
-
-			/* If the time for the next packet has already
-			   passed (by some margin), then we've lost time
-			   Adjust our expected timings accordingly. If
-			   we're only a little way behind, don't slip yet */
-			if (now.tv_usec > (now.tv_usec + (5 * pkt_delay) +
-					1000000 * (nextpkt.tv_sec - now.tv_sec))) {
-				nextpkt = now;
-			}
-
-			if (write(sock, &pktbuf, sizeof(pktbuf)) < 0) {
-				perror("write");
-				writeerrors++;
-				if (writeerrors > 10) {
-					fprintf(stderr, "Too many consecutive write errors\n");
-					exit(1);
-				}
-			} else
-				writeerrors = 0;
-
-
+			if (++nr_queued < SEND_BATCH)
+				continue;
 
+			pace((long long)nr_queued * sizeof(pktbuf));
+			send_pkts(sock, msgs, nr_queued);
+			nr_queued = 0;
 		}
 	}
 	munmap(image, st.st_size);
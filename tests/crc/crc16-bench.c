@@ -0,0 +1,113 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * Check the mkfs.ubifs crc16() against a bit-at-a-time reference
+ * implementation for all buffer lengths and alignments up to a limit, also
+ * when the buffer is fed in two pieces, then measure its throughput against
+ * the classic byte-at-a-time table loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "crc16.h"
+
+#define CHECK_LEN 1024
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+/* The CRC16 polynomial, bit reversed, one bit at a time */
+static uint16_t crc16_bitwise(uint16_t crc, const uint8_t *s, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *s++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xa001 & -(crc & 1));
+	}
+	return crc;
+}
+
+/* The byte-at-a-time table loop crc16() used to be */
+static uint16_t crc16_bytewise(uint16_t crc, const uint8_t *s, size_t len)
+{
+	while (len--)
+		crc = crc16_byte(crc, *s++);
+	return crc;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(uint16_t (*fn)(uint16_t, const uint8_t *, size_t),
+		    const uint8_t *buf, int len, uint16_t *res)
+{
+	double t = now();
+	uint16_t crc = 0xffff;
+	long i;
+
+	for (i = 0; i < BENCH_BYTES / len; i++)
+		crc = fn(crc, buf, len);
+	*res = crc;
+	return BENCH_BYTES / (now() - t) / (1024 * 1024);
+}
+
+int main(void)
+{
+	static const int lens[] = { 16, 64, 512, 4096, 65536 };
+	uint8_t *buf;
+	uint16_t seed, a, b;
+	int i, len, offs, split;
+
+	buf = malloc(65536 + 16);
+	if (!buf)
+		return 1;
+	for (i = 0; i < 65536 + 16; i++)
+		buf[i] = rand();
+
+	for (len = 0; len <= CHECK_LEN; len++) {
+		for (offs = 0; offs < 16; offs++) {
+			seed = rand();
+			split = len ? rand() % len : 0;
+			a = crc16(seed, buf + offs, split);
+			a = crc16(a, buf + offs + split, len - split);
+			b = crc16_bitwise(seed, buf + offs, len);
+			if (a != b) {
+				fprintf(stderr, "mismatch: len %d offs %d "
+					"split %d seed %#04x: %#04x != %#04x\n",
+					len, offs, split, seed, a, b);
+				return 1;
+			}
+		}
+	}
+	printf("crc16() matches the reference for lengths 0-%d\n", CHECK_LEN);
+
+	printf("%8s %12s %12s\n", "length", "bytewise", "crc16");
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		double t1, t2;
+
+		t1 = bench(crc16_bytewise, buf, lens[i], &a);
+		t2 = bench(crc16, buf, lens[i], &b);
+		if (a != b) {
+			fprintf(stderr, "benchmark results differ\n");
+			return 1;
+		}
+		printf("%8d %7.0f MiB/s %7.0f MiB/s\n", lens[i], t1, t2);
+	}
+	free(buf);
+	return 0;
+}
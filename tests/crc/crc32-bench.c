@@ -0,0 +1,123 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * Check mtd_crc32() against a bit-at-a-time reference implementation for all
+ * buffer lengths and alignments up to a limit, then measure its throughput
+ * against the classic byte-at-a-time table loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "crc32.h"
+
+#define CHECK_LEN 1024
+#define BENCH_BYTES (512 * 1024 * 1024)
+
+static uint32_t byte_table[256];
+
+/* The CRC32 polynomial, bit reversed, one bit at a time */
+static uint32_t crc32_bitwise(uint32_t val, const unsigned char *s, int len)
+{
+	int i;
+
+	while (len--) {
+		val ^= *s++;
+		for (i = 0; i < 8; i++)
+			val = (val >> 1) ^ (0xedb88320 & -(val & 1));
+	}
+	return val;
+}
+
+/* The byte-at-a-time table loop mtd_crc32() used to be */
+static uint32_t crc32_bytewise(uint32_t val, const unsigned char *s, int len)
+{
+	while (--len >= 0)
+		val = byte_table[(val ^ *s++) & 0xff] ^ (val >> 8);
+	return val;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(uint32_t (*fn)(uint32_t, const void *, int),
+		    const unsigned char *buf, int len, uint32_t *res)
+{
+	double t = now();
+	uint32_t val = 0;
+	long i;
+
+	for (i = 0; i < BENCH_BYTES / len; i++)
+		val = fn(val, buf, len);
+	*res = val;
+	return BENCH_BYTES / (now() - t) / (1024 * 1024);
+}
+
+static uint32_t bytewise(uint32_t val, const void *buf, int len)
+{
+	return crc32_bytewise(val, buf, len);
+}
+
+int main(void)
+{
+	static const int lens[] = { 16, 64, 512, 4096, 65536 };
+	unsigned char *buf;
+	uint32_t seed, a, b;
+	int i, len, offs;
+
+	buf = malloc(65536 + 16);
+	if (!buf)
+		return 1;
+	for (i = 0; i < 65536 + 16; i++)
+		buf[i] = rand();
+	for (i = 0; i < 256; i++) {
+		unsigned char c = i;
+
+		byte_table[i] = crc32_bitwise(0, &c, 1);
+	}
+
+	for (len = 0; len <= CHECK_LEN; len++) {
+		for (offs = 0; offs < 16; offs++) {
+			seed = rand();
+			a = mtd_crc32(seed, buf + offs, len);
+			b = crc32_bitwise(seed, buf + offs, len);
+			if (a != b) {
+				fprintf(stderr, "mismatch: len %d offs %d "
+					"seed %#08x: %#08x != %#08x\n",
+					len, offs, seed, a, b);
+				return 1;
+			}
+		}
+	}
+	printf("mtd_crc32() matches the reference for lengths 0-%d\n",
+	       CHECK_LEN);
+
+	printf("%8s %12s %12s\n", "length", "bytewise", "mtd_crc32");
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		double t1, t2;
+
+		t1 = bench(bytewise, buf, lens[i], &a);
+		t2 = bench(mtd_crc32, buf, lens[i], &b);
+		if (a != b) {
+			fprintf(stderr, "benchmark results differ\n");
+			return 1;
+		}
+		printf("%8d %7.0f MiB/s %7.0f MiB/s\n", lens[i], t1, t2);
+	}
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * Check every vector version of the libfec addmul1() the CPU supports against
+ * the scalar one for all multipliers and for all buffer lengths and
+ * alignments up to a limit, then measure their throughput. Finally, check
+ * that fec_decode() and fec_decode_batch() recover blocks which lost packets
+ * in recurring patterns. The library source is included directly to get at
+ * its internals.
+ */
+
+#include <time.h>
+#include "../../lib/libfec.c"
+
+#define CHECK_LEN 300
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+/* Geometry of a 128KiB eraseblock as sent by serve_image */
+#define PKT_SZ 2820
+#define DEC_K ((131072 + PKT_SZ - 1) / PKT_SZ)
+#define DEC_N (DEC_K * 3 / 2)
+#define DEC_BLOCKS 64
+#define DEC_PATTERNS 4
+
+struct kernel {
+	const char *name;
+	int *flag;
+};
+
+static const struct kernel kernels[] = {
+	{ "scalar", NULL },
+#ifdef FEC_X86
+	{ "ssse3", &fec_use_ssse3 },
+	{ "avx2", &fec_use_avx2 },
+#endif
+#ifdef FEC_NEON
+	{ "neon", &fec_use_neon },
+#endif
+};
+
+#define KERNEL_CNT (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static int supported[KERNEL_CNT];
+
+/* Make addmul1() use kernel number @k */
+static void select_kernel(int k)
+{
+	int i;
+
+	for (i = 1; i < KERNEL_CNT; i++)
+		*kernels[i].flag = (i == k);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check(int k, gf *src, gf *ref, gf *dst)
+{
+	int c, len, offs;
+
+	select_kernel(k);
+	for (c = 0; c < GF_SIZE + 1; c++) {
+		for (len = 0; len <= CHECK_LEN; len++) {
+			offs = rand() % 16;
+			memcpy(ref, src + 1024, len);
+			memcpy(dst + offs, src + 1024, len);
+			addmul1_scalar(ref, src + offs, c, len);
+			addmul1(dst + offs, src + offs, c, len);
+			if (memcmp(ref, dst + offs, len)) {
+				fprintf(stderr, "%s: mismatch: c %d len %d "
+					"offs %d\n", kernels[k].name, c, len,
+					offs);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static double bench(int k, gf *src, gf *dst, int len)
+{
+	double t;
+	long i;
+
+	select_kernel(k);
+	t = now();
+	for (i = 0; i < BENCH_BYTES / len; i++)
+		addmul1(dst, src, 0x53 + (i & 0x7f), len);
+	return BENCH_BYTES / (now() - t) / (1024 * 1024);
+}
+
+/*
+ * Encode DEC_BLOCKS blocks, throw away the packets given by one of
+ * DEC_PATTERNS loss patterns from each and receive the rest in random order,
+ * then decode them with fec_decode() if @batch is zero and with
+ * fec_decode_batch() otherwise.
+ */
+static int check_decode(struct fec_parms *code, int batch)
+{
+	static gf *pkts[DEC_BLOCKS][DEC_K], **pkt_ptrs[DEC_BLOCKS];
+	static int index[DEC_BLOCKS][DEC_K], *index_ptrs[DEC_BLOCKS];
+	char lost[DEC_PATTERNS][DEC_N];
+	gf *data, *p;
+	int b, i, j, nr, err = 0;
+	double t;
+
+	data = malloc(DEC_BLOCKS * DEC_K * PKT_SZ);
+	p = malloc(DEC_BLOCKS * DEC_K * PKT_SZ);
+	if (!data || !p)
+		return -1;
+	for (i = 0; i < DEC_BLOCKS * DEC_K * PKT_SZ; i++)
+		data[i] = rand();
+
+	memset(lost, 0, sizeof(lost));
+	for (i = 0; i < DEC_PATTERNS; i++)
+		for (j = 0; j < DEC_N - DEC_K; j++)
+			lost[i][rand() % DEC_N] = 1;
+
+	for (b = 0; b < DEC_BLOCKS; b++) {
+		const char *l = lost[b % DEC_PATTERNS];
+		int order[DEC_N];
+
+		for (i = 0; i < DEC_N; i++) {
+			j = rand() % (i + 1);
+			order[i] = order[j];
+			order[j] = i;
+		}
+		for (i = nr = 0; i < DEC_N && nr < DEC_K; i++) {
+			j = order[i];
+			if (l[j])
+				continue;
+			pkts[b][nr] = p + (b * DEC_K + nr) * PKT_SZ;
+			fec_encode_linear(code, data + b * DEC_K * PKT_SZ,
+					  pkts[b][nr], j, PKT_SZ);
+			index[b][nr++] = j;
+		}
+		if (nr < DEC_K)
+			return -1;
+		pkt_ptrs[b] = pkts[b];
+		index_ptrs[b] = index[b];
+	}
+
+	t = now();
+	if (batch)
+		err = fec_decode_batch(code, pkt_ptrs, index_ptrs, DEC_BLOCKS,
+				       PKT_SZ);
+	else
+		for (b = 0; b < DEC_BLOCKS && !err; b++)
+			err = fec_decode(code, pkts[b], index[b], PKT_SZ);
+	t = now() - t;
+
+	for (b = 0; b < DEC_BLOCKS && !err; b++)
+		for (i = 0; i < DEC_K && !err; i++)
+			err = memcmp(pkts[b][i],
+				     data + (b * DEC_K + i) * PKT_SZ, PKT_SZ);
+	if (err)
+		fprintf(stderr, "%s: decoded data differs\n",
+			batch ? "fec_decode_batch" : "fec_decode");
+	else
+		printf("%s: decoded %d blocks in %.1f ms\n",
+		       batch ? "fec_decode_batch" : "fec_decode", DEC_BLOCKS,
+		       t * 1000);
+	free(data);
+	free(p);
+	return err ? -1 : 0;
+}
+
+int main(void)
+{
+	static const int lens[] = { 64, 1024, 65536 };
+	struct fec_parms *code;
+	gf *src, *dst, *ref;
+	int i, k;
+
+	src = malloc(65536 + 2048);
+	dst = malloc(65536 + 16);
+	ref = malloc(65536);
+	if (!src || !dst || !ref)
+		return 1;
+	for (i = 0; i < 65536 + 2048; i++)
+		src[i] = rand();
+
+	init_fec();
+	supported[0] = 1;
+	for (k = 1; k < KERNEL_CNT; k++)
+		supported[k] = *kernels[k].flag;
+
+	for (k = 1; k < KERNEL_CNT; k++) {
+		if (!supported[k]) {
+			printf("%s: not supported by this CPU\n",
+			       kernels[k].name);
+			continue;
+		}
+		if (check(k, src, ref, dst))
+			return 1;
+		printf("%s: matches the scalar version for lengths 0-%d\n",
+		       kernels[k].name, CHECK_LEN);
+	}
+
+	printf("%8s", "length");
+	for (k = 0; k < KERNEL_CNT; k++)
+		if (supported[k])
+			printf(" %12s", kernels[k].name);
+	printf("\n");
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		printf("%8d", lens[i]);
+		for (k = 0; k < KERNEL_CNT; k++)
+			if (supported[k])
+				printf(" %7.0f MiB/s",
+				       bench(k, src, dst, lens[i]));
+		printf("\n");
+	}
+	free(src);
+	free(dst);
+	free(ref);
+
+	for (k = 1; k < KERNEL_CNT; k++)
+		*kernels[k].flag = supported[k];
+	code = fec_new(DEC_K, DEC_N);
+	if (!code)
+		return 1;
+	if (check_decode(code, 0) || check_decode(code, 1))
+		return 1;
+	fec_free(code);
+	return 0;
+}
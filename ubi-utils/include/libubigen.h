@@ -90,6 +90,62 @@ struct ubigen_vol_info
 	uint8_t flags;
 };
 
+/*
+ * Compact volume images.
+ *
+ * A compact image contains a volume image (e.g., an UBIFS image generated by
+ * mkfs.ubifs) without the 0xFF bytes at the end of LEBs. It starts with
+ * &struct ubigen_compact_hdr, which is followed by @tbl_cnt &struct
+ * ubigen_compact_leb records, one per LEB, which tell where the LEB data are
+ * stored in the compact image file. The rest of each LEB consists of 0xFF
+ * bytes. All the fields are little-endian.
+ *
+ * Compact images are not detected by their contents, since any volume image
+ * may start with the magic. The user has to say an image is compact (see
+ * 'ubigen_write_compact_volume()'), and the header CRC and padding are then
+ * checked to catch mistakes.
+ */
+#define UBIGEN_COMPACT_MAGIC 0x504D4355 /* "UCMP" */
+
+/**
+ * struct ubigen_compact_hdr - compact image header.
+ * @magic: compact image magic (%UBIGEN_COMPACT_MAGIC)
+ * @leb_size: LEB size of the volume image
+ * @leb_cnt: count of LEBs in the volume image
+ * @tbl_cnt: count of LEB records following the header (not less than
+ *           @leb_cnt)
+ * @tbl_crc: CRC32 checksum of the LEB records (initial value is
+ *           %UBI_CRC32_INIT)
+ * @padding: reserved, zeroes
+ * @hdr_crc: CRC32 checksum of the header up to this field (initial value is
+ *           %UBI_CRC32_INIT)
+ */
+struct ubigen_compact_hdr {
+	uint32_t magic;
+	uint32_t leb_size;
+	uint32_t leb_cnt;
+	uint32_t tbl_cnt;
+	uint32_t tbl_crc;
+	uint8_t padding[8];
+	uint32_t hdr_crc;
+} __attribute__ ((packed));
+
+/* Size of the compact image header part covered by @hdr_crc */
+#define UBIGEN_COMPACT_HDR_SIZE_CRC \
+	(sizeof(struct ubigen_compact_hdr) - sizeof(uint32_t))
+
+/**
+ * struct ubigen_compact_leb - compact image LEB record.
+ * @offs: offset of the LEB data in the compact image file
+ * @len: length of the LEB data
+ * @padding: reserved, zeroes
+ */
+struct ubigen_compact_leb {
+	uint64_t offs;
+	uint32_t len;
+	uint32_t padding;
+} __attribute__ ((packed));
+
 /**
  * ubigen_info_init - initialize libubigen.
  * @ui: libubigen information
@@ -171,6 +227,32 @@ int ubigen_write_volume(const struct ubigen_info *ui,
 			const struct ubigen_vol_info *vi, long long ec,
 			long long bytes, int in, int out);
 
+/**
+ * ubigen_write_compact_volume - write UBI volume from a compact image.
+ * @ui: libubigen information
+ * @vi: volume information
+ * @ec: erase counter value to put to EC headers
+ * @bytes: volume size in bytes
+ * @in: compact image file descriptor
+ * @out: output file descriptor
+ *
+ * This function is the same as 'ubigen_write_volume()', except that @in is a
+ * compact image, which is expanded on the fly.
+ */
+int ubigen_write_compact_volume(const struct ubigen_info *ui,
+				const struct ubigen_vol_info *vi, long long ec,
+				long long bytes, int in, int out);
+
+/**
+ * ubigen_compact_size - get size of the volume image in a compact image.
+ * @fd: compact image file descriptor
+ * @bytes: size of the volume image is returned here
+ *
+ * This function returns zero in case of success and %-1 if @fd is not a valid
+ * compact image.
+ */
+int ubigen_compact_size(int fd, long long *bytes);
+
 /**
  * ubigen_write_layout_vol - write UBI layout volume
  * @ui: libubigen information
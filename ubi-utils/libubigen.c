@@ -30,6 +30,8 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 
 #include <mtd/ubi-media.h>
 #include <mtd_swab.h>
@@ -168,11 +170,158 @@ void ubigen_init_vid_hdr(const struct ubigen_info *ui,
 	hdr->hdr_crc = cpu_to_be32(crc);
 }
 
-int ubigen_write_volume(const struct ubigen_info *ui,
+/**
+ * read_compact_hdr - read the header of a compact image.
+ * @fd: image file descriptor
+ * @hdr: the header is returned here (in CPU byte order)
+ *
+ * Returns zero in case of success and %-1 if @fd is not a valid compact image.
+ */
+static int read_compact_hdr(int fd, struct ubigen_compact_hdr *hdr)
+{
+	uint32_t crc;
+	size_t i;
+
+	if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+	    le32_to_cpu(hdr->magic) != UBIGEN_COMPACT_MAGIC) {
+		errmsg("not a compact image");
+		errno = EINVAL;
+		return -1;
+	}
+
+	crc = mtd_crc32(UBI_CRC32_INIT, hdr, UBIGEN_COMPACT_HDR_SIZE_CRC);
+	if (le32_to_cpu(hdr->hdr_crc) != crc) {
+		errmsg("bad compact image header CRC %#08x, should be %#08x",
+		       le32_to_cpu(hdr->hdr_crc), crc);
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < sizeof(hdr->padding); i++)
+		if (hdr->padding[i])
+			break;
+
+	hdr->leb_size = le32_to_cpu(hdr->leb_size);
+	hdr->leb_cnt = le32_to_cpu(hdr->leb_cnt);
+	hdr->tbl_cnt = le32_to_cpu(hdr->tbl_cnt);
+	hdr->tbl_crc = le32_to_cpu(hdr->tbl_crc);
+	if (i != sizeof(hdr->padding) ||
+	    hdr->leb_size == 0 || hdr->leb_size > INT_MAX ||
+	    hdr->leb_cnt > hdr->tbl_cnt || hdr->tbl_cnt > INT_MAX /
+	    sizeof(struct ubigen_compact_leb)) {
+		errmsg("bad compact image header");
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * read_compact_tbl - read the LEB records of a compact image.
+ * @fd: image file descriptor
+ * @hdr: compact image header
+ *
+ * Returns the LEB records in case of success and %NULL in case of failure.
+ */
+static struct ubigen_compact_leb *
+read_compact_tbl(int fd, const struct ubigen_compact_hdr *hdr)
+{
+	struct ubigen_compact_leb *tbl;
+	size_t sz = hdr->tbl_cnt * sizeof(struct ubigen_compact_leb);
+
+	tbl = malloc(sz ? sz : 1);
+	if (!tbl) {
+		sys_errmsg("cannot allocate %zu bytes of memory", sz);
+		return NULL;
+	}
+	if (pread(fd, tbl, sz, sizeof(*hdr)) != (ssize_t)sz) {
+		sys_errmsg("cannot read compact image LEB table");
+		goto out_free;
+	}
+	if (mtd_crc32(UBI_CRC32_INIT, tbl, sz) != hdr->tbl_crc) {
+		errmsg("bad compact image LEB table CRC");
+		errno = EINVAL;
+		goto out_free;
+	}
+	return tbl;
+
+out_free:
+	free(tbl);
+	return NULL;
+}
+
+/**
+ * read_compact - read data of a volume image from a compact image.
+ * @fd: image file descriptor
+ * @hdr: compact image header
+ * @tbl: compact image LEB records
+ * @pos: position in the volume image to read from
+ * @buf: buffer to read to
+ * @len: how many bytes to read
+ */
+static int read_compact(int fd, const struct ubigen_compact_hdr *hdr,
+			const struct ubigen_compact_leb *tbl, long long pos,
+			char *buf, int len)
+{
+	while (len) {
+		int lnum = pos / hdr->leb_size, offs = pos % hdr->leb_size;
+		int l = hdr->leb_size - offs, dlen, n = 0;
+
+		if (l > len)
+			l = len;
+		if (lnum >= (int)hdr->leb_cnt) {
+			errmsg("compact image has only %u LEBs", hdr->leb_cnt);
+			errno = EINVAL;
+			return -1;
+		}
+
+		dlen = le32_to_cpu(tbl[lnum].len);
+		if (offs < dlen) {
+			off_t from = le64_to_cpu(tbl[lnum].offs) + offs;
+
+			n = dlen - offs;
+			if (n > l)
+				n = l;
+			if (pread(fd, buf, n, from) != n)
+				return sys_errmsg("cannot read %d bytes from the input file", n);
+		}
+		memset(buf + n, 0xFF, l - n);
+
+		buf += l;
+		pos += l;
+		len -= l;
+	}
+	return 0;
+}
+
+int ubigen_compact_size(int fd, long long *bytes)
+{
+	struct ubigen_compact_hdr hdr;
+	int ret;
+
+	ret = read_compact_hdr(fd, &hdr);
+	if (!ret)
+		*bytes = (long long)hdr.leb_cnt * hdr.leb_size;
+	return ret;
+}
+
+/**
+ * write_volume - write UBI volume.
+ * @ui: libubigen information
+ * @vi: volume information
+ * @ec: erase counter value to put to EC headers
+ * @bytes: volume size in bytes
+ * @in: input file descriptor
+ * @out: output file descriptor
+ * @compact: @in is a compact image
+ */
+static int write_volume(const struct ubigen_info *ui,
 			const struct ubigen_vol_info *vi, long long ec,
-			long long bytes, int in, int out)
+			long long bytes, int in, int out, int compact)
 {
 	int len = vi->usable_leb_size, rd, lnum = 0;
+	struct ubigen_compact_hdr hdr;
+	struct ubigen_compact_leb *tbl = NULL;
+	long long pos = 0;
 	char *inbuf, *outbuf;
 
 	if (vi->id >= ui->max_volumes) {
@@ -189,10 +338,20 @@ int ubigen_write_volume(const struct ubigen_info *ui,
 		return -1;
 	}
 
+	if (compact) {
+		if (read_compact_hdr(in, &hdr))
+			return -1;
+		tbl = read_compact_tbl(in, &hdr);
+		if (!tbl)
+			return -1;
+	}
+
 	inbuf = malloc(ui->leb_size);
-	if (!inbuf)
+	if (!inbuf) {
+		free(tbl);
 		return sys_errmsg("cannot allocate %d bytes of memory",
 				  ui->leb_size);
+	}
 	outbuf = malloc(ui->peb_size);
 	if (!outbuf) {
 		sys_errmsg("cannot allocate %d bytes of memory", ui->peb_size);
@@ -210,16 +369,22 @@ int ubigen_write_volume(const struct ubigen_info *ui,
 			len = bytes;
 		bytes -= len;
 
-		l = len;
-		do {
-			rd = read(in, inbuf + len - l, l);
-			if (rd != l) {
-				sys_errmsg("cannot read %d bytes from the input file", l);
+		if (compact) {
+			if (read_compact(in, &hdr, tbl, pos, inbuf, len))
 				goto out_free1;
-			}
-
-			l -= rd;
-		} while (l);
+			pos += len;
+		} else {
+			l = len;
+			do {
+				rd = read(in, inbuf + len - l, l);
+				if (rd != l) {
+					sys_errmsg("cannot read %d bytes from the input file", l);
+					goto out_free1;
+				}
+
+				l -= rd;
+			} while (l);
+		}
 
 		vid_hdr = (struct ubi_vid_hdr *)(&outbuf[ui->vid_hdr_offs]);
 		ubigen_init_vid_hdr(ui, vi, vid_hdr, lnum, inbuf, len);
@@ -238,15 +403,31 @@ int ubigen_write_volume(const struct ubigen_info *ui,
 
 	free(outbuf);
 	free(inbuf);
+	free(tbl);
 	return 0;
 
 out_free1:
 	free(outbuf);
 out_free:
 	free(inbuf);
+	free(tbl);
 	return -1;
 }
 
+int ubigen_write_volume(const struct ubigen_info *ui,
+			const struct ubigen_vol_info *vi, long long ec,
+			long long bytes, int in, int out)
+{
+	return write_volume(ui, vi, ec, bytes, in, out, 0);
+}
+
+int ubigen_write_compact_volume(const struct ubigen_info *ui,
+				const struct ubigen_vol_info *vi, long long ec,
+				long long bytes, int in, int out)
+{
+	return write_volume(ui, vi, ec, bytes, in, out, 1);
+}
+
 int ubigen_write_layout_vol(const struct ubigen_info *ui, int peb1, int peb2,
 			    long long ec1, long long ec2,
 			    struct ubi_vtbl_record *vtbl, int fd)
@@ -111,6 +111,10 @@ static const char ini_doc[] = "INI-file format.\n"
 "  * if \"vol_size\" key is absent, the volume size is assumed to be\n"
 "    equivalent to the size of the image file (defined by \"image\" key);\n"
 "  * if the \"image\" is absent, the volume is assumed to be empty;\n"
+"  * the \"image_type=compact\" key tells that the \"image\" is a compact\n"
+"    image (e.g., generated by \"mkfs.ubifs --compact\"), which is expanded\n"
+"    on the fly, and its size is the size of the volume image it contains;\n"
+"    the default is \"image_type=raw\";\n"
 "  * volume alignment must not be greater than the logical eraseblock size;\n"
 "  * one ini file may contain arbitrary number of sections, the utility will\n"
 "    put all the volumes which are described by these section to the output\n"
@@ -285,14 +289,40 @@ static int parse_opt(int argc, char * const argv[])
 	return 0;
 }
 
+/*
+ * Get information about a volume image file. In case of a compact image, the
+ * size of the volume image it contains is returned in @st->st_size.
+ */
+static int stat_image(const char *img, int compact, struct stat *st)
+{
+	long long bytes;
+	int fd, ret;
+
+	if (stat(img, st))
+		return -1;
+	if (!compact)
+		return 0;
+
+	fd = open(img, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	ret = ubigen_compact_size(fd, &bytes);
+	close(fd);
+	if (ret)
+		return -1;
+	st->st_size = bytes;
+	return 0;
+}
+
 static int read_section(const struct ubigen_info *ui, const char *sname,
 			struct ubigen_vol_info *vi, const char **img,
-			struct stat *st)
+			int *compact, struct stat *st)
 {
 	char buf[256];
 	const char *p;
 
 	*img = NULL;
+	*compact = 0;
 
 	if (strlen(sname) > 128)
 		return errmsg("too long section name \"%s\"", sname);
@@ -335,12 +365,23 @@ static int read_section(const struct ubigen_info *ui, const char *sname,
 	verbose(args.verbose, "volume type: %s",
 		vi->type == UBI_VID_DYNAMIC ? "dynamic" : "static");
 
+	/* Fetch the type of the volume image file */
+	sprintf(buf, "%s:image_type", sname);
+	p = iniparser_getstring(args.dict, buf, NULL);
+	if (p) {
+		if (!strcmp(p, "compact"))
+			*compact = 1;
+		else if (strcmp(p, "raw"))
+			return errmsg("invalid image type \"%s\" in section \"%s\"",
+				      p, sname);
+	}
+
 	/* Fetch the name of the volume image file */
 	sprintf(buf, "%s:image", sname);
 	p = iniparser_getstring(args.dict, buf, NULL);
 	if (p) {
 		*img = p;
-		if (stat(p, st))
+		if (stat_image(p, *compact, st))
 			return sys_errmsg("cannot stat \"%s\" referred from section \"%s\"",
 					  p, sname);
 		if (st->st_size == 0)
@@ -386,7 +427,7 @@ static int read_section(const struct ubigen_info *ui, const char *sname,
 			return errmsg("neither image file (\"image=\") nor volume size "
 				      "(\"vol_size=\") specified in section \"%s\"", sname);
 
-		if (stat(*img, &st))
+		if (stat_image(*img, *compact, &st))
 			return sys_errmsg("cannot stat \"%s\"", *img);
 
 		vi->bytes = st.st_size;
@@ -526,6 +567,7 @@ int main(int argc, char * const argv[])
 	for (i = 0; i < sects; i++) {
 		const char *sname = iniparser_getsecname(args.dict, i);
 		const char *img = NULL;
+		int compact;
 		struct stat st;
 		int fd, j;
 
@@ -538,7 +580,7 @@ int main(int argc, char * const argv[])
 			printf("\n");
 		verbose(args.verbose, "parsing section \"%s\"", sname);
 
-		err = read_section(&ui, sname, &vi[i], &img, &st);
+		err = read_section(&ui, sname, &vi[i], &img, &compact, &st);
 		if (err == -1)
 			goto out_free;
 
@@ -587,7 +629,11 @@ int main(int argc, char * const argv[])
 			verbose(args.verbose, "writing volume %d", vi[i].id);
 			verbose(args.verbose, "image file: %s", img);
 
-			err = ubigen_write_volume(&ui, &vi[i], args.ec, st.st_size, fd, args.out_fd);
+			if (compact)
+				err = ubigen_write_compact_volume(&ui, &vi[i], args.ec,
+								  st.st_size, fd, args.out_fd);
+			else
+				err = ubigen_write_volume(&ui, &vi[i], args.ec, st.st_size, fd, args.out_fd);
 			close(fd);
 			if (err) {
 				errmsg("cannot write volume for section \"%s\"", sname);